@@ -0,0 +1,622 @@
+/* Author:          Steely Morneau
+ * Description:     Micro-benchmarks for the garbage collector (gc.c). Each benchmark
+                    is selected by name on the command line and prints one line per
+                    measurement.
+ * Compile:         gcc -O2 -Wall -o bench gc.c bench.c -lpthread
+ * Usage:           ./bench align
+ *
+ * align:           mark + copy throughput for a binary tree of nodes with odd-sized
+ *                  strings hanging off them, every other allocation garbage so that
+ *                  all live data slides. Build once per alignment to compare, e.g.
+ *                  gcc -O2 -DGC_ALIGNMENT=1 ... against the default of 8 and 16.
+ * headers:         live-set size and GC time for a pointer-dense tree of small
+ *                  nodes. Build with and without -DGC_COMPACT_HEADERS to compare
+ *                  the header layouts.
+ * order:           mutator tree traversal time after a collection under each
+ *                  compaction order, for a tree whose nodes and names were
+ *                  allocated in an order unrelated to its shape.
+ * hugepages:       GC time and dTLB load misses during collection of a large
+ *                  heap with each GC_HEAP_* backing. Misses are read through
+ *                  perf_event_open and reported as n/a where it is not allowed.
+ * hybrid:          a heap where ~85% of the data survives each collection while
+ *                  the mutator keeps replacing node names, run with compaction on
+ *                  every collection and with a compaction threshold that sweeps
+ *                  into holes instead.
+ * heaps:           1 to 8 threads, each repeatedly building and dropping a list,
+ *                  with one gc_heap_t per thread and then with all of them in
+ *                  the default heap behind a lock. Reports the total time and
+ *                  the longest single allocation, which includes any collection
+ *                  and, when sharing, waiting for the lock.
+ * image:           startup time for a large tree of named nodes, built with
+ *                  gc_alloc() and loaded from an image written by
+ *                  gc_save_image(); the first walk after loading touches and,
+ *                  with full headers, relocates every page.
+ * policy:          a mutator whose live data alternates between a short and a
+ *                  long list every phase, with no goal (collect when the heap
+ *                  is full) and under each gc_set_goal() goal. Reports the run
+ *                  time, time spent collecting, the longest pause, and how
+ *                  large the heap limit and the resident heap end up.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "gc.h"
+
+typedef struct Node /* extends Object */ {
+    GC_HEADER
+
+    int key;
+    GC_REF(String) name;
+    GC_REF(struct Node) left;
+    GC_REF(struct Node) right;
+} Node;
+
+ClassDescriptor Node_class = {
+    "Node",
+    sizeof (struct Node),
+    3, /* name, left, right fields */
+    (int []) {
+        offsetof(struct Node, name),
+        offsetof(struct Node, left),
+        offsetof(struct Node, right)
+    }
+};
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* build a complete tree of the given depth, leaving a dead string between
+ * every pair of live allocations */
+static Node *build_tree(int depth, int *key) {
+    Node *n;
+
+    if(depth == 0) {
+        return NULL;
+    }
+    n = (Node *) gc_alloc(&Node_class);
+    n->key = (*key)++;
+    gc_alloc_string(5 + n->key % 7); /* garbage */
+    n->name = gc_store(gc_alloc_string(3 + n->key % 11));
+    n->left = gc_store(build_tree(depth - 1, key));
+    n->right = gc_store(build_tree(depth - 1, key));
+    return n;
+}
+
+/* build a complete tree of named nodes with no garbage in between */
+static Node *build_dense_tree(int depth, int *key) {
+    Node *n;
+
+    if(depth == 0) {
+        return NULL;
+    }
+    n = (Node *) gc_alloc(&Node_class);
+    n->key = (*key)++;
+    n->name = gc_store(gc_alloc_string(3 + n->key % 11));
+    n->left = gc_store(build_dense_tree(depth - 1, key));
+    n->right = gc_store(build_dense_tree(depth - 1, key));
+    return n;
+}
+
+/* build a complete tree of bare nodes, every other allocation garbage */
+static Node *build_bare_tree(int depth, int *key) {
+    Node *n;
+
+    if(depth == 0) {
+        return NULL;
+    }
+    n = (Node *) gc_alloc(&Node_class);
+    n->key = (*key)++;
+    gc_alloc(&Node_class); /* garbage */
+    n->left = gc_store(build_bare_tree(depth - 1, key));
+    n->right = gc_store(build_bare_tree(depth - 1, key));
+    return n;
+}
+
+static void bench_align() {
+    int depth = 18, rounds = 10, i, key;
+    size_t live;
+    double start, total = 0;
+    Node *root = NULL;
+
+    gc_init((size_t) 256 << 20);
+    gc_save_rp;
+    gc_add_root(root);
+
+    for(i = 0; i < rounds; i++) {
+        key = 0;
+        root = NULL;
+        gc(); /* start every round from an empty heap */
+        root = build_tree(depth, &key);
+        start = now();
+        gc();
+        total += now() - start;
+    }
+
+    live = gc_used();
+    printf("align=%d nodes=%d live=%zu bytes gc=%.3f ms copy=%.1f MB/s\n",
+           GC_ALIGNMENT, key, live, total * 1000 / rounds,
+           live / (total / rounds) / (1 << 20));
+
+    gc_restore_roots;
+    gc_done();
+}
+
+/* what the mutator does: visit every node and touch its name */
+static long walk(Node *n) {
+    String *name;
+
+    if(n == NULL) {
+        return 0;
+    }
+    name = gc_load(n->name);
+    return n->key + name->str[0] + walk(gc_load(n->left)) + walk(gc_load(n->right));
+}
+
+static void bench_order() {
+    int n = 1 << 20, rounds = 10, order, i, j, t;
+    char *names[] = {"address", "dfs", "bfs"};
+    int *perm = malloc(n * sizeof(int));
+    Node **nodes = malloc(n * sizeof(Node *));
+    Node *root = NULL;
+    double start, total;
+    long sum = 0;
+
+    for(order = GC_ORDER_ADDRESS; order <= GC_ORDER_BFS; order++) {
+        gc_init((size_t) 512 << 20);
+        gc_set_compaction_order(order);
+        gc_save_rp;
+        gc_add_root(root);
+
+        /* shuffle which allocation becomes which tree position */
+        srand(42);
+        for(i = 0; i < n; i++) {
+            perm[i] = i;
+        }
+        for(i = n - 1; i > 0; i--) {
+            j = rand() % (i + 1);
+            t = perm[i]; perm[i] = perm[j]; perm[j] = t;
+        }
+        for(i = 0; i < n; i++) {
+            nodes[i] = (Node *) gc_alloc(&Node_class);
+            nodes[i]->key = i;
+        }
+        for(i = 0; i < n; i++) {
+            nodes[i]->name = gc_store(gc_alloc_string(8));
+            gc_alloc_string(8); /* garbage */
+        }
+        for(i = 0; i < n; i++) {
+            if(2 * i + 1 < n) {
+                nodes[perm[i]]->left = gc_store(nodes[perm[2 * i + 1]]);
+            }
+            if(2 * i + 2 < n) {
+                nodes[perm[i]]->right = gc_store(nodes[perm[2 * i + 2]]);
+            }
+        }
+        root = nodes[perm[0]];
+
+        start = now();
+        gc();
+        printf("order=%-7s gc=%.3f ms", names[order], (now() - start) * 1000);
+
+        total = 0;
+        for(i = 0; i < rounds; i++) {
+            start = now();
+            sum += walk(root);
+            total += now() - start;
+        }
+        printf(" traversal=%.3f ms\n", total * 1000 / rounds);
+
+        gc_restore_roots;
+        gc_done();
+    }
+    if(sum == 42) {
+        printf("\n"); /* keep the walks from being optimized away */
+    }
+    free(perm);
+    free(nodes);
+}
+
+/* counter of data TLB load misses for this thread, or -1 */
+static int open_dtlb_counter() {
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB |
+            (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+            (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void bench_hugepages() {
+    int flags[] = {0, GC_HEAP_THP, GC_HEAP_HUGETLB, GC_HEAP_THP | GC_HEAP_INTERLEAVE,
+            GC_HEAP_THP | GC_HEAP_LOCAL};
+    char *names[] = {"4k", "thp", "hugetlb", "thp+interleave", "thp+local"};
+    int depth = 20, rounds = 5, f, i, key, fd;
+    long long misses, total_misses;
+    double start, total;
+    Node *root = NULL;
+
+    for(f = 0; f < 5; f++) {
+        gc_init_with((size_t) 1 << 30, flags[f]);
+        gc_save_rp;
+        gc_add_root(root);
+        fd = open_dtlb_counter();
+        total = 0;
+        total_misses = 0;
+
+        for(i = 0; i < rounds; i++) {
+            key = 0;
+            root = NULL;
+            gc();
+            root = build_tree(depth, &key);
+            if(fd >= 0) {
+                ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+                ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+            }
+            start = now();
+            gc();
+            total += now() - start;
+            if(fd >= 0) {
+                ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+                if(read(fd, &misses, sizeof(misses)) == sizeof(misses)) {
+                    total_misses += misses;
+                }
+            }
+        }
+
+        printf("heap=%-15s gc=%.3f ms dtlb_misses=", names[f], total * 1000 / rounds);
+        if(fd >= 0) {
+            printf("%lld\n", total_misses / rounds);
+            close(fd);
+        } else {
+            printf("n/a\n");
+        }
+
+        gc_restore_roots;
+        gc_done();
+    }
+}
+
+static void bench_hybrid() {
+    double thresholds[] = {0, 0.3};
+    int depth = 16, steps = 2000000, t, i, d, key;
+    Node *root = NULL, *n = NULL;
+    String *name;
+    double start, elapsed;
+    gc_stats stats;
+
+    for(t = 0; t < 2; t++) {
+        /* ~7 MB live in an 8 MB heap */
+        gc_init((size_t) 8 << 20);
+        gc_set_compaction_threshold(thresholds[t]);
+        gc_save_rp;
+        gc_add_root(root);
+        gc_add_root(n); /* allocating below may move it */
+        key = 0;
+        root = build_dense_tree(depth, &key);
+
+        srand(7);
+        start = now();
+        for(i = 0; i < steps; i++) {
+            /* the old name of a random node becomes garbage */
+            for(n = root, d = rand() % depth; d > 0 && n->left != 0; d--) {
+                n = gc_load(rand() & 1 ? n->left : n->right);
+            }
+            name = gc_alloc_string(3 + i % 11);
+            n->name = gc_store(name);
+        }
+        elapsed = now() - start;
+
+        gc_get_stats(&stats);
+        printf("threshold=%.2f run=%.3f ms collections=%ld compactions=%ld copied=%zu MB\n",
+               thresholds[t], elapsed * 1000, stats.collections, stats.compactions,
+               stats.bytes_copied >> 20);
+
+        gc_restore_roots;
+        gc_done();
+    }
+}
+
+#define MAX_THREADS 8
+
+typedef struct Worker {
+    pthread_t thread;
+    gc_heap_t *heap;        /* NULL to share the default heap */
+    Node **list;            /* root in the default heap when sharing */
+    long steps;
+    double longest;
+} Worker;
+
+static pthread_mutex_t shared_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* prepend nodes to a list, starting over every 20000 nodes */
+static void *run_worker(void *arg) {
+    Worker *w = arg;
+    gc_heap_t *h = w->heap;
+    Node *list = NULL, *n;
+    double start, step;
+    long i;
+
+    if(h != NULL) {
+        gc_heap_save_rp(h);
+        gc_heap_add_root(h, list);
+        for(i = 0; i < w->steps; i++) {
+            start = now();
+            n = (Node *) gc_heap_alloc(h, &Node_class);
+            n->key = i;
+            n->left = gc_heap_store(h, i % 20000 == 0 ? NULL : list);
+            list = n;
+            step = now() - start;
+            w->longest = step > w->longest ? step : w->longest;
+        }
+        gc_heap_restore_roots(h);
+        return NULL;
+    }
+    for(i = 0; i < w->steps; i++) {
+        start = now();
+        /* a collection for another thread may move this thread's list */
+        pthread_mutex_lock(&shared_lock);
+        n = (Node *) gc_alloc(&Node_class);
+        n->key = i;
+        n->left = gc_store(i % 20000 == 0 ? NULL : *w->list);
+        *w->list = n;
+        pthread_mutex_unlock(&shared_lock);
+        step = now() - start;
+        w->longest = step > w->longest ? step : w->longest;
+    }
+    return NULL;
+}
+
+static void bench_heaps() {
+    size_t heap_size = (size_t) 4 << 20;
+    Worker workers[MAX_THREADS];
+    Node *lists[MAX_THREADS];
+    int threads, shared, t;
+    double start, elapsed, longest;
+
+    for(shared = 0; shared < 2; shared++) {
+        for(threads = 1; threads <= MAX_THREADS; threads *= 2) {
+            memset(workers, 0, sizeof(workers));
+            if(shared) {
+                gc_init(threads * heap_size);
+            }
+            gc_save_rp;
+            for(t = 0; t < threads; t++) {
+                lists[t] = NULL;
+                gc_add_root(lists[t]);
+                workers[t].heap = shared ? NULL : gc_heap_init(heap_size, 0);
+                workers[t].list = &lists[t];
+                workers[t].steps = 2000000;
+            }
+
+            start = now();
+            for(t = 0; t < threads; t++) {
+                pthread_create(&workers[t].thread, NULL, run_worker, &workers[t]);
+            }
+            longest = 0;
+            for(t = 0; t < threads; t++) {
+                pthread_join(workers[t].thread, NULL);
+                longest = workers[t].longest > longest ? workers[t].longest : longest;
+            }
+            elapsed = now() - start;
+
+            printf("heaps=%-9s threads=%d run=%.3f ms longest_alloc=%.3f ms\n",
+                   shared ? "shared" : "per-thread", threads, elapsed * 1000,
+                   longest * 1000);
+
+            gc_restore_roots;
+            for(t = 0; t < threads; t++) {
+                if(workers[t].heap != NULL) {
+                    gc_heap_done(workers[t].heap);
+                }
+            }
+            if(shared) {
+                gc_done();
+            }
+        }
+    }
+}
+
+static void bench_image() {
+    int depth = 20, key = 0;
+    char path[] = "/tmp/bench_imageXXXXXX";
+    ClassDescriptor *classes[] = {&Node_class, NULL};
+    Node *root = NULL;
+    double start;
+    long sum;
+
+    close(mkstemp(path));
+    gc_init((size_t) 256 << 20);
+    {
+        gc_save_rp;
+        gc_add_root(root);
+        start = now();
+        root = build_dense_tree(depth, &key);
+        printf("build=%.3f ms", (now() - start) * 1000);
+        sum = walk(root);
+        start = now();
+        gc_save_image(path);
+        printf(" save=%.3f ms size=%zu bytes\n", (now() - start) * 1000, gc_used());
+        gc_restore_roots;
+        gc_done();
+    }
+
+    root = NULL;
+    gc_init((size_t) 256 << 20);
+    {
+        gc_save_rp;
+        gc_add_root(root);
+        start = now();
+        if(gc_load_image(path, classes) != GC_IMAGE_OK) {
+            printf("\ncannot load %s\n", path);
+        }
+        printf("load=%.3f ms", (now() - start) * 1000);
+        start = now();
+        if(walk(root) != sum) {
+            printf(" (loaded tree differs)");
+        }
+        printf(" first walk=%.3f ms\n", (now() - start) * 1000);
+        gc_restore_roots;
+        gc_done();
+    }
+    unlink(path);
+}
+
+/* resident pages of the process, in MB */
+static long resident_mb() {
+    long size = 0, resident = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+
+    if(f != NULL) {
+        if(fscanf(f, "%ld %ld", &size, &resident) != 2) {
+            resident = 0;
+        }
+        fclose(f);
+    }
+    return resident * sysconf(_SC_PAGESIZE) >> 20;
+}
+
+/* build_dense_tree() for a heap that may collect while building */
+static Node *build_rooted_tree(int depth, int *key) {
+    Node *n = NULL, *child = NULL;
+    String *name = NULL;
+
+    if(depth == 0) {
+        return NULL;
+    }
+    gc_save_rp;
+    gc_add_root(n);
+    gc_add_root(child);
+    gc_add_root(name);
+    n = (Node *) gc_alloc(&Node_class);
+    n->key = (*key)++;
+    name = gc_alloc_string(3 + n->key % 11);
+    n->name = gc_store(name);
+    child = build_rooted_tree(depth - 1, key);
+    n->left = gc_store(child);
+    child = build_rooted_tree(depth - 1, key);
+    n->right = gc_store(child);
+    gc_restore_roots;
+    return n;
+}
+
+static void bench_policy() {
+    int goals[] = {GC_GOAL_NONE, GC_GOAL_THROUGHPUT, GC_GOAL_THROUGHPUT, GC_GOAL_PAUSE};
+    double values[] = {0, 0.05, 0.2, 2};
+    int depths[] = {19, 10}; /* ~50 MB and ~0.1 MB live */
+    int steps = 4000000, g, phase, i, d, key;
+    Node *root = NULL, *n = NULL;
+    String *name;
+    double start, elapsed;
+    gc_stats stats;
+
+    for(g = 0; g < 4; g++) {
+        gc_init((size_t) 256 << 20);
+        gc_set_goal(goals[g], values[g]);
+        gc_save_rp;
+        gc_add_root(root);
+        gc_add_root(n);
+
+        srand(7);
+        start = now();
+        for(phase = 0; phase < 6; phase++) {
+            /* a new tree replaces the last, then its names keep being replaced */
+            root = NULL;
+            key = 0;
+            root = build_rooted_tree(depths[phase % 2], &key);
+            for(i = 0; i < steps; i++) {
+                for(n = root, d = rand() % depths[phase % 2]; d > 0 && n->left != 0; d--) {
+                    n = gc_load(rand() & 1 ? n->left : n->right);
+                }
+                name = gc_alloc_string(3 + i % 11);
+                n->name = gc_store(name);
+            }
+        }
+        elapsed = now() - start;
+
+        gc_get_stats(&stats);
+        printf("goal=%-10s %-4g run=%.3f ms gc=%.3f ms collections=%ld "
+               "longest_pause=%.3f ms limit=%zu MB resident=%ld MB\n",
+               goals[g] == GC_GOAL_NONE ? "none" :
+               goals[g] == GC_GOAL_THROUGHPUT ? "throughput" : "pause", values[g],
+               elapsed * 1000, stats.gc_seconds * 1000, stats.collections,
+               stats.longest_pause * 1000, stats.heap_limit >> 20, resident_mb());
+
+        gc_restore_roots;
+        gc_done();
+    }
+}
+
+static void bench_headers() {
+    int depth = 20, rounds = 10, i, key;
+    double start, total = 0;
+    Node *root = NULL;
+
+    gc_init((size_t) 256 << 20);
+    gc_save_rp;
+    gc_add_root(root);
+
+    for(i = 0; i < rounds; i++) {
+        key = 0;
+        root = NULL;
+        gc();
+        root = build_bare_tree(depth, &key);
+        start = now();
+        gc();
+        total += now() - start;
+    }
+
+#ifdef GC_COMPACT_HEADERS
+    printf("layout=compact ");
+#else
+    printf("layout=full ");
+#endif
+    printf("nodes=%d node=%zu bytes live=%zu bytes gc=%.3f ms\n",
+           key, GC_ALIGN(sizeof(Node)), gc_used(), total * 1000 / rounds);
+
+    gc_restore_roots;
+    gc_done();
+}
+
+int main(int argc, char *argv[]) {
+    if(argc < 2) {
+        printf("usage: %s align|headers|order|hugepages|hybrid|heaps|image|policy\n", argv[0]);
+        return 1;
+    }
+    if(strcmp(argv[1], "align") == 0) {
+        bench_align();
+    } else if(strcmp(argv[1], "headers") == 0) {
+        bench_headers();
+    } else if(strcmp(argv[1], "order") == 0) {
+        bench_order();
+    } else if(strcmp(argv[1], "hugepages") == 0) {
+        bench_hugepages();
+    } else if(strcmp(argv[1], "hybrid") == 0) {
+        bench_hybrid();
+    } else if(strcmp(argv[1], "heaps") == 0) {
+        bench_heaps();
+    } else if(strcmp(argv[1], "image") == 0) {
+        bench_image();
+    } else if(strcmp(argv[1], "policy") == 0) {
+        bench_policy();
+    } else {
+        printf("unknown benchmark %s\n", argv[1]);
+        return 1;
+    }
+    return 0;
+}
@@ -7,78 +7,821 @@
 #include <stddef.h>
 #include <string.h>
 #include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <pthread.h>
 #include "gc.h"
+#ifdef GC_VERIFY
+#include <stdarg.h>
+#endif
 
-void mark(Object* obj);
-void setForwarding();
-void changePointers(Object* obj);
-char *printObjectsFromRoots();
-void moveObjects();
-char *doFields(Object* obj, char* buf);
+#define HUGE_PAGE_SIZE          ((size_t) 2 << 20)
+/* from <linux/mman.h>: hugetlb pages of 2^21 bytes, not the host's default size */
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB            (21 << 26)
+#endif
+/* memory policies from <linux/mempolicy.h>; called through syscall() so
+ * libnuma is not needed */
+#define MPOL_PREFERRED          1
+#define MPOL_INTERLEAVE         3
+#define MPOL_F_MEMS_ALLOWED     (1 << 2)
+#define MAX_NUMA_NODES          1024
 
-void* heap;
+void mark(gc_heap_t *h, Object* obj);
+void setForwarding(gc_heap_t *h);
+void changePointers(gc_heap_t *h, Object* obj);
+char *printObjectsFromRoots(gc_heap_t *h);
+void moveObjects(gc_heap_t *h);
+char *doFields(gc_heap_t *h, Object* obj, char* buf);
+size_t objectSize(Object* obj);
+ClassDescriptor *classOf(Object* obj);
+int registerClass(ClassDescriptor *class);
+Object *getField(gc_heap_t *h, Object* obj, int offset);
+void setField(gc_heap_t *h, Object* obj, int offset, Object* value);
+Object *forwardingOf(gc_heap_t *h, Object* obj);
+void evacuateLive(gc_heap_t *h);
+Object *evacuate(gc_heap_t *h, Object* obj);
+void scanCopy(gc_heap_t *h, Object* copy);
+void *mapHeap(gc_heap_t *h, size_t size, int flags);
+void placeHeap(void *mem, size_t len, int flags);
+int isMarked(gc_heap_t *h, Object* obj);
+Object *relocate(gc_heap_t *h, Object* obj);
+void processReferences(gc_heap_t *h);
+void markEphemerons(gc_heap_t *h);
+void clearWeakRefs(gc_heap_t *h);
+void relocateReferences(gc_heap_t *h);
+void rehashTable(gc_weak_table *table);
+int tableSlot(gc_weak_table *table, Object *key);
+void tableInsert(gc_weak_table *table, Object *key, Object *value);
+void *allocate(gc_heap_t *h, size_t size);
+void *takeSpace(gc_heap_t *h, size_t size);
+int collect(gc_heap_t *h, int compact);
+void sizeHeap(gc_heap_t *h, size_t used, double pause, double mutatorTime);
+double seconds();
+ClassDescriptor *imageClass(ClassDescriptor **classes, char *name, size_t size, 
+      int numFields, int *offsets);
+void sweep(gc_heap_t *h);
+
+#ifdef GC_VERIFY
+/* free space is filled with this and must still hold it when reused */
+#define POISON 0xdb
+#define VERIFY(...) __VA_ARGS__
+void verifyHeap(gc_heap_t *h, const char *when);
+void verifyForwarding(gc_heap_t *h);
+void verifyRef(gc_heap_t *h, Object *ref, char *starts, const char *when, const char *what);
+void verifyFailed(const char *when, const char *format, ...);
+void checkPoison(gc_heap_t *h, size_t start, size_t end, const char *when);
+void poisonFree(gc_heap_t *h, size_t oldNextFree);
+void verifyFresh(gc_heap_t *h, void *p, size_t size);
+#else
+#define VERIFY(...)
+#endif
+
+#define REFERENT offsetof(WeakRef, referent)
+#ifdef GC_COMPACT_HEADERS
+#define MAX_STRING  (UINT32_MAX - 1)  /* length holds size + 1 in 32 bits */
+#else
+#define MAX_STRING  (SIZE_MAX - sizeof(struct String) - GC_ALIGNMENT)  /* so the size cannot wrap */
+#endif
+#define MAX_CLASSES 4096
+
+#ifdef GC_COMPACT_HEADERS
+#define GRANULE        8
+#define GRANULES(n)    ((n) / GRANULE)
+#define BITS_PER_WORD  64
+#endif
+
+struct gc_weak_table {
+   Object **keys;     /* open addressing; NULL is an empty slot */
+   Object **values;
+   int capacity;      /* power of 2 */
+   int size;
+   gc_heap_t *owner;  /* NULL once the heap is gone */
+   struct gc_weak_table *next; /* every live table of the heap, so gc() can find them */
+};
+
+typedef struct Finalizer {
+   Object *obj;
+   void (*finalize)(Object *obj);
+} Finalizer;
+
+/* pinned objects, sorted by address; they are roots and never move */
+typedef struct Pin {
+   Object *obj;
+   int count;
+} Pin;
+
+/* free range [start, end) of heap offsets below nextFree */
+typedef struct Hole {
+   size_t start;
+   size_t end;
+   int next;           /* index + 1 of the next hole of its size class, 0 for none */
+} Hole;
+
+/* holes of fewer than SMALL_HOLE granules are filed by their exact size,
+ * larger ones by the highest bit of their size */
+#define SMALL_HOLE    64
+#define HOLE_CLASSES  128
+
+/* sorted by address */
+typedef struct HoleList {
+   Hole *holes;
+   int num, max;
+} HoleList;
+
+/* everything one heap needs; heaps share nothing but the class table */
+struct gc_heap {
+   void* heap;         /* must stay first, gc_heap_load() reads it */
+   Object ***roots;    /* _roots for the default heap, else rootStack */
+   int *rp;
+   Object **rootStack[MAX_ROOTS];
+   int numRoots;
+   size_t nextFree;
+   size_t heapSize;
+   size_t heapMapped;  /* heapSize rounded up to whole (huge) pages */
+   int compactionOrder;
+   int collectOrder;   /* order used by the collection in progress */
+   /* compact only when more than this fraction of the used heap is free */
+   double compactionThreshold;
+   size_t markedBytes;
+   gc_stats stats;
+   
+   /* survivors are copied here in traversal order, then back to the heap */
+   void* scratch;
+   size_t scratchUsed;
+   
+   /* weak refs reached while marking; their referents are cleared or
+    * forwarded once marking is over */
+   Object **discovered;
+   int numDiscovered, maxDiscovered;
+   gc_weak_table *weakTables;
+   
+   /* objects to finalize once unreachable, and unreachable ones waiting for
+    * gc_run_finalizers(); the latter are roots until their finalizer runs */
+   Finalizer *finalizers;
+   int numFinalizers, maxFinalizers;
+   Finalizer *pending;
+   int numPending, maxPending;
+   
+   Pin *pins;
+   int numPins, maxPins;
+   
+   /* free space allocation reuses before bumping nextFree; heap walks skip it.
+    * Allocation finds them through one list per size class, so a request that
+    * fits nowhere leaves them all for smaller ones. */
+   HoleList freeHoles;
+   int holeClasses[HOLE_CLASSES];  /* index + 1 of each class's first hole */
+   uint64_t holeClassMask[HOLE_CLASSES / 64];  /* bit c set when class c has a hole */
+   /* holes the compaction in progress leaves in front of pinned objects */
+   HoleList nextHoles;
+   
+   /* when to collect; see sizeHeap() */
+   int goal;
+   double goalValue;
+   size_t softLimit;      /* collect before allocating past this */
+   size_t heapTop;        /* end of the pages that may be resident */
+   size_t allocatedBytes; /* since the last collection */
+   double lastCollection; /* when it finished */
+   /* smoothed over recent collections */
+   double allocRate;      /* bytes allocated per second of mutator time */
+   double pausePerByte;   /* seconds of collection per byte of used heap */
+   double survival;       /* fraction of the used heap found live */
+
+#ifdef GC_COMPACT_HEADERS
+   /* one mark bit per heap granule; live objects have every granule marked so
+    * the number of live bytes below an address is a popcount away */
+   uint64_t *markBits;
+   /* live bytes below the first granule of each mark word; only allocated
+    * between setForwarding() and moveObjects() */
+   size_t *blockOffsets;
+   /* how much further than the live bytes below it each pinned object, and
+    * everything after it, lands; also only exists while compacting */
+   size_t *pinShifts;
+#endif
+};
+
+/* what the gc_* functions without a heap argument work on */
+gc_heap_t defaultHeap;
 Object **_roots[MAX_ROOTS];
 int _rp;
-int nextFree;
-int heapSize;
+#ifdef GC_COMPACT_HEADERS
+void *heap;         /* start of the default heap, for gc_load()/gc_store() */
+#endif
+
+void addHole(HoleList *list, size_t start, size_t end);
+void fileHole(gc_heap_t *h, int k);
+int holeClass(size_t size);
+int holeClassFrom(gc_heap_t *h, int c);
+void indexHoles(gc_heap_t *h);
+void swapHoles(gc_heap_t *h);
+void initHeap(gc_heap_t *h, size_t size, int flags);
+void freeHeap(gc_heap_t *h);
+
+/* class table, shared by all heaps; index 0 is reserved so an unregistered
+ * class has id 0. Slots never move, so only registering takes the lock. */
+ClassDescriptor *classTable[MAX_CLASSES];
+int numClasses = 1;
+pthread_mutex_t classLock = PTHREAD_MUTEX_INITIALIZER;
+
+#ifdef GC_COMPACT_HEADERS
+void setMarked(gc_heap_t *h, Object* obj);
+#endif
 
 /* initialize the garbage collector and a static-sized heap */
-void gc_init(int size) {
+void gc_init(size_t size) {
+   gc_init_with(size, 0);
+}
+
+/* initialize with a heap backed as the GC_HEAP_* flags ask */
+void gc_init_with(size_t size, int flags) {
+   initHeap(&defaultHeap, size, flags);
+   defaultHeap.roots = _roots;
+   defaultHeap.rp = &_rp;
    _rp = 0;
-   heap = (void*) malloc(size);
-   memset(heap, 0, size);
-   nextFree = 0;
-   heapSize = size;
+#ifdef GC_COMPACT_HEADERS
+   heap = defaultHeap.heap;
+#endif
+}
+
+/* a heap of its own, independent of the default one and of any other; a
+ * heap must only be used by one thread at a time */
+gc_heap_t *gc_heap_init(size_t size, int flags) {
+   gc_heap_t *h = malloc(sizeof(gc_heap_t));
+   
+   initHeap(h, size, flags);
+   h->roots = h->rootStack;
+   h->rp = &h->numRoots;
+   return h;
+}
+
+void initHeap(gc_heap_t *h, size_t size, int flags) {
+   memset(h, 0, sizeof(gc_heap_t));
+#ifdef GC_COMPACT_HEADERS
+   if(size > GC_MAX_HEAP) {
+      printf("Heap limited to %zu bytes with compressed references.", GC_MAX_HEAP);
+      size = GC_MAX_HEAP;
+   }
+   h->markBits = calloc(GRANULES(size) / BITS_PER_WORD + 1, sizeof(uint64_t));
+#endif
+   h->heap = mapHeap(h, size, flags); /* anonymous pages come zeroed */
+   if(h->heap == NULL) {
+      /* a heap with no room, so allocation returns NULL */
+      size = h->heapMapped = 0;
+   }
+   h->heapSize = size;
+   h->softLimit = size;
+   h->heapTop = size;
+   h->lastCollection = seconds();
+   h->compactionOrder = GC_ORDER_ADDRESS;
+   VERIFY(if(h->heap != NULL) memset(h->heap, POISON, h->heapSize));
+}
+
+/* mmap the heap, huge page aligned when huge pages are wanted so whole
+ * 2 MB pages can back it */
+void *mapHeap(gc_heap_t *h, size_t size, int flags) {
+   size_t page = sysconf(_SC_PAGESIZE), slop;
+   void *mem = MAP_FAILED;
+   
+   if(flags & (GC_HEAP_THP | GC_HEAP_HUGETLB)) {
+      page = HUGE_PAGE_SIZE;
+   }
+   h->heapMapped = (size + page - 1) & ~(page - 1);
+   
+   if(flags & GC_HEAP_HUGETLB) {
+      mem = mmap(NULL, h->heapMapped, PROT_READ | PROT_WRITE, 
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_HUGE_2MB, -1, 0);
+      /* no huge pages reserved; fall back to transparent ones */
+      flags |= mem == MAP_FAILED ? GC_HEAP_THP : 0;
+   }
+   if(mem == MAP_FAILED) {
+      mem = mmap(NULL, h->heapMapped + page, PROT_READ | PROT_WRITE, 
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if(mem == MAP_FAILED) {
+         printf("Cannot map a heap of %zu bytes.", size);
+         return NULL;
+      }
+      /* trim to a page aligned start */
+      slop = (page - (size_t) mem % page) % page;
+      if(slop > 0) {
+         munmap(mem, slop);
+      }
+      munmap(mem + slop + h->heapMapped, page - slop);
+      mem += slop;
+   }
+   
+   if(flags & GC_HEAP_THP) {
+      madvise(mem, h->heapMapped, MADV_HUGEPAGE);
+   }
+   placeHeap(mem, h->heapMapped, flags);
+   return mem;
+}
+
+/* NUMA placement is a hint; kernels without NUMA support just refuse */
+void placeHeap(void *mem, size_t len, int flags) {
+   unsigned long nodes[MAX_NUMA_NODES / (8 * sizeof(unsigned long))] = {0};
+   unsigned cpu, node;
+   
+   if(flags & GC_HEAP_INTERLEAVE) {
+      /* spread pages over every node this process may allocate from */
+      if(syscall(SYS_get_mempolicy, NULL, nodes, MAX_NUMA_NODES, NULL, 
+            MPOL_F_MEMS_ALLOWED) == 0) {
+         syscall(SYS_mbind, mem, len, MPOL_INTERLEAVE, nodes, MAX_NUMA_NODES, 0);
+      }
+   } else if(flags & GC_HEAP_LOCAL) {
+      /* keep pages on the node of the thread that owns the heap */
+      if(syscall(SYS_getcpu, &cpu, &node, NULL) == 0) {
+         nodes[node / (8 * sizeof(unsigned long))] |= 
+               1UL << (node % (8 * sizeof(unsigned long)));
+         syscall(SYS_mbind, mem, len, MPOL_PREFERRED, nodes, MAX_NUMA_NODES, 0);
+      }
+   }
+}
+
+/* choose how survivors are laid out; call after gc_init() */
+void gc_heap_set_compaction_order(gc_heap_t *h, int order) {
+   h->compactionOrder = order;
+}
+
+/* compact only when more than fraction of the used heap is free; other
+ * collections just sweep the dead objects into holes for allocation to
+ * fill. 0, the default, compacts every time. */
+void gc_heap_set_compaction_threshold(gc_heap_t *h, double fraction) {
+   h->compactionThreshold = fraction;
+}
+
+void gc_heap_get_stats(gc_heap_t *h, gc_stats *out) {
+   *out = h->stats;
+   out->survival = h->survival;
+   out->heap_limit = h->softLimit;
+}
+
+/* let collections come sooner than a full heap would make them, as often as
+ * meeting the GC_GOAL_* goal allows. The first comes at a quarter of the
+ * heap; later ones wherever what the earlier ones measured says. */
+void gc_heap_set_goal(gc_heap_t *h, int goal, double value) {
+   h->goal = goal;
+   h->goalValue = value;
+   h->softLimit = h->heapSize;
+   if(goal != GC_GOAL_NONE && GC_ALIGN(h->heapSize / 4) > h->nextFree) {
+      h->softLimit = GC_ALIGN(h->heapSize / 4);
+   }
 }
 
 /* garbage collection on the heap */
-void gc() {
+void gc_heap_collect(gc_heap_t *h) {
+   collect(h, 0);
+}
+
+/* collect, compacting when asked to or when fragmentation calls for it;
+ * returns whether it compacted */
+int collect(gc_heap_t *h, int compact) {
    int i;
+   gc_weak_table *t;
+   size_t used = h->nextFree;
+   double start = seconds();
+   VERIFY(size_t oldNextFree = h->nextFree);
    
-   for (i = 0; i < _rp; i++) { 
-      mark(*_roots[i]);
+   VERIFY(verifyHeap(h, "before gc"));
+   h->markedBytes = 0;
+   h->stats.collections++;
+   for (i = 0; i < *h->rp; i++) { 
+      mark(h, *h->roots[i]);
+   }
+   for (i = 0; i < h->numPending; i++) {
+      mark(h, h->pending[i].obj);
+   }
+   for (i = 0; i < h->numPins; i++) {
+      mark(h, h->pins[i].obj);
    }
+   processReferences(h);
+   
+   compact = compact || h->compactionThreshold <= 0 || 
+         h->nextFree - h->markedBytes > h->compactionThreshold * h->nextFree;
+   
+   /* pinned objects cannot be evacuated, so slide around them instead */
+   h->collectOrder = h->numPins > 0 ? GC_ORDER_ADDRESS : h->compactionOrder;
+   if(compact && h->collectOrder != GC_ORDER_ADDRESS) {
+      /* evacuating needs a buffer the size of the used heap; without one, slide */
+      h->scratch = malloc(h->nextFree);
+      h->collectOrder = h->scratch == NULL ? GC_ORDER_ADDRESS : h->collectOrder;
+   }
+   if(!compact) {
+      sweep(h);
+   } else if(h->collectOrder != GC_ORDER_ADDRESS) {
+      evacuateLive(h);
+   } else {
+      setForwarding(h);
+      VERIFY(verifyForwarding(h));
       
-   setForwarding();
+      for (i = 0; i < *h->rp; i++) {
+         *h->roots[i] = relocate(h, *h->roots[i]);
+      }
+      relocateReferences(h);
       
-   for (i = 0; i < _rp; i++) {
-      if(*_roots[i] == NULL) {
+      moveObjects(h);
+   }
+   
+   for(t = h->weakTables; t != NULL; t = t->next) {
+      rehashTable(t);
+   }
+   h->numDiscovered = 0;
+   h->stats.compactions += compact;
+   VERIFY(poisonFree(h, oldNextFree));
+   VERIFY(verifyHeap(h, "after gc"));
+   sizeHeap(h, used, seconds() - start, start - h->lastCollection);
+   return compact;
+}
+
+/* without moving anything, turn each run of dead objects and old holes
+ * into one hole and clear the marks of the live objects in between */
+void sweep(gc_heap_t *h) {
+   size_t i = 0, freeStart = 0, step;
+   int k = 0, inRun = 0;
+   Object* o;
+   
+   while(i < h->nextFree) {
+      
+      if(k < h->freeHoles.num && i == h->freeHoles.holes[k].start) {
+         if(h->freeHoles.holes[k].end > i && !inRun) {
+            freeStart = i;
+            inRun = 1;
+         }
+         i = h->freeHoles.holes[k++].end;
+         continue;
+      }
+      
+      o = (Object*) (h->heap + i);
+      step = objectSize(o);
+      
+      if(isMarked(h, o)) {
+         if(inRun) {
+            addHole(&h->nextHoles, freeStart, i);
+            inRun = 0;
+         }
+#ifndef GC_COMPACT_HEADERS
+         o->marked = 0;
+#endif
+      } else if(!inRun) {
+         freeStart = i;
+         inRun = 1;
+      }
+      
+      i += step;
+   }
+   
+#ifdef GC_COMPACT_HEADERS
+   memset(h->markBits, 0, (GRANULES(h->nextFree) / BITS_PER_WORD + 1) * sizeof(uint64_t));
+#endif
+   /* free space at the end goes back to bump allocation */
+   if(inRun) {
+      h->nextFree = freeStart;
+   }
+   swapHoles(h);
+}
+
+/* where a root-like reference points after this collection; with sliding
+ * compaction this also fixes the fields of everything it reaches */
+Object *relocate(gc_heap_t *h, Object* obj) {
+   if(obj == NULL || (void*)obj < h->heap || (void*)obj > h->heap + h->heapSize) {
+      return obj;
+   }
+   if(h->collectOrder != GC_ORDER_ADDRESS) {
+      return evacuate(h, obj);
+   }
+#ifndef GC_COMPACT_HEADERS
+   /* compact headers fix fields while moving instead */
+   changePointers(h, obj);
+#endif
+   return forwardingOf(h, obj);
+}
+
+/* decide the fate of weak refs, ephemerons and finalizable objects once
+ * everything strongly reachable is marked */
+void processReferences(gc_heap_t *h) {
+   int i, j;
+   gc_weak_table *t;
+   
+   markEphemerons(h);
+   clearWeakRefs(h);
+   
+   /* unreachable objects with finalizers come back to life until their
+    * finalizer has run; weak refs to them are already cleared */
+   for(i = 0, j = 0; i < h->numFinalizers; i++) {
+      if(isMarked(h, h->finalizers[i].obj)) {
+         h->finalizers[j++] = h->finalizers[i];
          continue;
       }
+      if(h->numPending == h->maxPending) {
+         h->maxPending = h->maxPending == 0 ? 16 : 2 * h->maxPending;
+         h->pending = realloc(h->pending, h->maxPending * sizeof(Finalizer));
+      }
+      h->pending[h->numPending++] = h->finalizers[i];
+      mark(h, h->finalizers[i].obj);
+   }
+   h->numFinalizers = j;
+   
+   /* resurrection may have revived keys and reached more weak refs */
+   markEphemerons(h);
+   clearWeakRefs(h);
+   
+   for(t = h->weakTables; t != NULL; t = t->next) {
+      for(i = 0; i < t->capacity; i++) {
+         if(t->keys[i] != NULL && !isMarked(h, t->keys[i])) {
+            t->keys[i] = NULL;
+            t->values[i] = NULL;
+         }
+      }
+   }
+}
 
-      changePointers(*_roots[i]);
-      *_roots[i] = (*_roots[i])->forwarded;
+/* mark values whose keys are marked until no more keys come alive */
+void markEphemerons(gc_heap_t *h) {
+   int i, changed = 1;
+   gc_weak_table *t;
+   
+   while(changed) {
+      changed = 0;
+      for(t = h->weakTables; t != NULL; t = t->next) {
+         for(i = 0; i < t->capacity; i++) {
+            if(t->keys[i] != NULL && t->values[i] != NULL && 
+                  isMarked(h, t->keys[i]) && !isMarked(h, t->values[i])) {
+               mark(h, t->values[i]);
+               changed = 1;
+            }
+         }
+      }
    }
+}
+
+void clearWeakRefs(gc_heap_t *h) {
+   int i;
+   Object* referent;
    
-   moveObjects();
+   for(i = 0; i < h->numDiscovered; i++) {
+      referent = getField(h, h->discovered[i], REFERENT);
+      if(referent != NULL && !isMarked(h, referent)) {
+         setField(h, h->discovered[i], REFERENT, NULL);
+      }
+   }
+}
+
+/* pending finalizers, registered objects, table entries and pinned objects
+ * move like roots; pinned ones to where they already are */
+void relocateReferences(gc_heap_t *h) {
+   int i;
+   gc_weak_table *t;
    
+   for(i = 0; i < h->numPins; i++) {
+      h->pins[i].obj = relocate(h, h->pins[i].obj);
+   }
+   for(i = 0; i < h->numPending; i++) {
+      h->pending[i].obj = relocate(h, h->pending[i].obj);
+   }
+   for(i = 0; i < h->numFinalizers; i++) {
+      h->finalizers[i].obj = relocate(h, h->finalizers[i].obj);
+   }
+   for(t = h->weakTables; t != NULL; t = t->next) {
+      for(i = 0; i < t->capacity; i++) {
+         t->keys[i] = relocate(h, t->keys[i]);
+         t->values[i] = relocate(h, t->values[i]);
+      }
+   }
 }
 
 /* mark live objects */
-void mark(Object* obj) {
+void mark(gc_heap_t *h, Object* obj) {
    int i;
+   ClassDescriptor *class;
+   
+#ifdef GC_COMPACT_HEADERS
+   if(obj == NULL || (void*)obj < h->heap || (void*)obj > h->heap + h->heapSize ||
+         isMarked(h, obj)) {
+      return;
+   }
    
-   if(obj == NULL || obj->marked == 1 || (void*)obj < heap || 
-         (void*)obj > heap + heapSize) {
+   setMarked(h, obj);
+#else
+   if(obj == NULL || obj->marked == 1 || (void*)obj < h->heap || 
+         (void*)obj > h->heap + h->heapSize) {
       return;
    }
    
    obj->marked = 1;
+#endif
    
-   for(i = 0; i < obj->class->num_fields; i++) {
-      mark( *((Object**) (obj->class->field_offsets[i] + (void*)obj)) );   
+   h->markedBytes += objectSize(obj);
+   class = classOf(obj);
+   if(class == &WeakRef_class) {
+      if(h->numDiscovered == h->maxDiscovered) {
+         h->maxDiscovered = h->maxDiscovered == 0 ? 16 : 2 * h->maxDiscovered;
+         h->discovered = realloc(h->discovered, h->maxDiscovered * sizeof(Object*));
+      }
+      h->discovered[h->numDiscovered++] = obj;
+   }
+   for(i = 0; i < class->num_fields; i++) {
+      mark(h, getField(h, obj, class->field_offsets[i]));
    }
 
 }
 
+/* size in bytes an object occupies in the heap, padding included */
+size_t objectSize(Object* obj) {
+   ClassDescriptor *class = classOf(obj);
+   
+   if(class == &String_class) {
+      return GC_ALIGN(String_class.size + ((String*)obj)->length);
+   }
+   return GC_ALIGN(class->size);
+}
+
+ClassDescriptor *classOf(Object* obj) {
+#ifdef GC_COMPACT_HEADERS
+   return classTable[obj->class_id];
+#else
+   return obj->class;
+#endif
+}
+
+/* give a class its slot in the class table unless another thread just did;
+ * returns 0 once the table is full */
+int registerClass(ClassDescriptor *class) {
+   pthread_mutex_lock(&classLock);
+   if(class->id == 0 && numClasses < MAX_CLASSES) {
+      classTable[numClasses] = class;
+      /* the slot is filled before the id that leads to it is published */
+      __atomic_store_n(&class->id, numClasses++, __ATOMIC_RELEASE);
+   }
+   pthread_mutex_unlock(&classLock);
+   if(class->id == 0) {
+      printf("Too many classes.");
+      return 0;
+   }
+   return 1;
+}
+
+/* read the managed pointer stored offset bytes into obj */
+Object *getField(gc_heap_t *h, Object* obj, int offset) {
+#ifdef GC_COMPACT_HEADERS
+   return gc_heap_load(h, *(gc_ref*) ((void*)obj + offset));
+#else
+   return *(Object**) ((void*)obj + offset);
+#endif
+}
+
+void setField(gc_heap_t *h, Object* obj, int offset, Object* value) {
+#ifdef GC_COMPACT_HEADERS
+   *(gc_ref*) ((void*)obj + offset) = gc_heap_store(h, value);
+#else
+   *(Object**) ((void*)obj + offset) = value;
+#endif
+}
+
+#ifdef GC_COMPACT_HEADERS
+int isMarked(gc_heap_t *h, Object* obj) {
+   size_t g = GRANULES((void*)obj - h->heap);
+   
+   return (h->markBits[g / BITS_PER_WORD] >> (g % BITS_PER_WORD)) & 1;
+}
+
+/* mark every granule the object covers */
+void setMarked(gc_heap_t *h, Object* obj) {
+   size_t g = GRANULES((void*)obj - h->heap);
+   size_t end = g + GRANULES(objectSize(obj));
+   
+   for(; g < end; g++) {
+      h->markBits[g / BITS_PER_WORD] |= (uint64_t) 1 << (g % BITS_PER_WORD);
+   }
+}
+
+/* an object slides down by the dead bytes below it, so its new address is
+ * the live bytes before its mark word plus the live granules before it
+ * within that word */
+Object *forwardingOf(gc_heap_t *h, Object* obj) {
+   size_t g = GRANULES((void*)obj - h->heap);
+   uint64_t below = h->markBits[g / BITS_PER_WORD] &
+         (((uint64_t) 1 << (g % BITS_PER_WORD)) - 1);
+   size_t off = h->blockOffsets[g / BITS_PER_WORD] + 
+         __builtin_popcountll(below) * GRANULE;
+   int lo = 0, hi = h->numPins - 1, mid, last = -1;
+   
+   /* add the holes left in front of the pinned objects below it */
+   while(lo <= hi) {
+      mid = (lo + hi) / 2;
+      if(h->pins[mid].obj <= obj) {
+         last = mid;
+         lo = mid + 1;
+      } else {
+         hi = mid - 1;
+      }
+   }
+   if(last >= 0) {
+      off += h->pinShifts[last];
+   }
+   return (Object*) (h->heap + off);
+}
+
+/* prefix-sum the live granules of every mark word; no heap walk needed.
+ * Everything from a pinned object up lands pinShift further on, which
+ * leaves the pinned object where it is. */
+void setForwarding(gc_heap_t *h) {
+   size_t w, words = GRANULES(h->nextFree) / BITS_PER_WORD + 1, off = 0, to;
+   int p;
+   
+   h->blockOffsets = malloc(words * sizeof(size_t));
+   for(w = 0; w < words; w++) {
+      h->blockOffsets[w] = off;
+      off += __builtin_popcountll(h->markBits[w]) * GRANULE;
+   }
+   
+   h->pinShifts = malloc((h->numPins + 1) * sizeof(size_t));
+   for(p = 0; p < h->numPins; p++) {
+      /* where the pinned object would slide to given the earlier pins */
+      h->pinShifts[p] = p > 0 ? h->pinShifts[p - 1] : 0;
+      to = (void*)forwardingOf(h, h->pins[p].obj) - h->heap;
+      if(to < (size_t) ((void*)h->pins[p].obj - h->heap)) {
+         addHole(&h->nextHoles, to, (void*)h->pins[p].obj - h->heap);
+         h->pinShifts[p] += ((void*)h->pins[p].obj - h->heap) - to;
+      }
+   }
+}
+
+/* fix the fields of each live object, then slide it down */
+void moveObjects(gc_heap_t *h) {
+   size_t i = 0, newNextFree = 0, step;
+   int j;
+   Object* o;
+   Object* field;
+   Object* to;
+   ClassDescriptor *class;
+   int k = 0;
+   
+   while(i < h->nextFree) {
+      
+      if(k < h->freeHoles.num && i == h->freeHoles.holes[k].start) {
+         i = h->freeHoles.holes[k++].end;
+         continue;
+      }
+      
+      o = (Object*) (h->heap + i);
+      step = objectSize(o);
+      
+      if(isMarked(h, o)) {
+         class = classOf(o);
+         for(j = 0; j < class->num_fields; j++) {
+            field = getField(h, o, class->field_offsets[j]);
+            if(field != NULL) {
+               setField(h, o, class->field_offsets[j], forwardingOf(h, field));
+            }
+         }
+         if(class == &WeakRef_class && getField(h, o, REFERENT) != NULL) {
+            setField(h, o, REFERENT, forwardingOf(h, getField(h, o, REFERENT)));
+         }
+         to = forwardingOf(h, o);
+         if(to != o) {
+            memmove(to, o, step);
+            h->stats.bytes_copied += step;
+         }
+         newNextFree = (void*)to - h->heap + step;
+      }
+      
+      i += step;
+   }
+   
+   memset(h->markBits, 0, (GRANULES(h->nextFree) / BITS_PER_WORD + 1) * sizeof(uint64_t));
+   free(h->blockOffsets);
+   free(h->pinShifts);
+   h->blockOffsets = NULL;
+   h->pinShifts = NULL;
+   swapHoles(h);
+   h->nextFree = newNextFree;
+  
+}
+#else
+int isMarked(gc_heap_t *h, Object* obj) {
+   return obj->marked == 1;
+}
+
+Object *forwardingOf(gc_heap_t *h, Object* obj) {
+   return obj->forwarded;
+}
+
 /* walk live and compute forwarding addresses */
-void setForwarding() {
-   int i = 0, off = 0, step;
+void setForwarding(gc_heap_t *h) {
+   size_t i = 0, off = 0, step;
    Object* o;
+   int k = 0, p = 0;
    
-   while(i < nextFree) {
+   while(i < h->nextFree) {
 
-      o = (Object*) (heap + i);
+      if(k < h->freeHoles.num && i == h->freeHoles.holes[k].start) {
+         i = h->freeHoles.holes[k++].end;
+         continue;
+      }
+      
+      o = (Object*) (h->heap + i);
       if(o == NULL) {
          break;
       }
@@ -87,16 +830,22 @@ void setForwarding() {
          break;
       }
    
-      if(strcmp("String", (char*)(o->class->name)) == 0) {
-         step = ((String*)o)->length + String_class.size;
-      } else {
-         step = o->class->size;
-      }
+      step = objectSize(o);
       
+      // pinned objects stay put and whatever did not fill the gap below
+      // them becomes a hole
+      if(p < h->numPins && o == h->pins[p].obj) {
+         if(off < i) {
+            addHole(&h->nextHoles, off, i);
+         }
+         o->forwarded = o;
+         off = i + step;
+         o->marked = 0;
+         p++;
       // set forwarding address of live objects and ignore dead ones
-      if(o->marked == 1) {
+      } else if(o->marked == 1) {
          
-         o->forwarded = (Object*) (heap + off);
+         o->forwarded = (Object*) (h->heap + off);
          off += step;
          o->marked = 0;
       } else {
@@ -107,93 +856,603 @@ void setForwarding() {
 
 }
 
-/* change pointer field addresses and root addresses */
-void changePointers(Object* obj) {
-   int i;
-   Object** field;
+/* change pointer field addresses and root addresses */
+void changePointers(gc_heap_t *h, Object* obj) {
+   int i;
+   Object** field;
+   
+   if(obj == NULL || obj->marked == 1 || (void*)obj < h->heap || 
+         (void*)obj > h->heap + h->heapSize) {
+      return;
+   }
+   
+   obj->marked = 1;
+      
+   for(i = 0; i < obj->class->num_fields; i++) {
+      
+      field = ((Object**) (obj->class->field_offsets[i] + (void*)obj));
+      
+      if(*field == NULL) {
+         continue;
+      }
+      changePointers(h, *field); 
+      *field = (*field)->forwarded;
+   }
+   
+   /* referents still set survived marking, so they have a forwarding address */
+   if(obj->class == &WeakRef_class && getField(h, obj, REFERENT) != NULL) {
+      setField(h, obj, REFERENT, forwardingOf(h, getField(h, obj, REFERENT)));
+   }
+}
+
+/* move objects */
+void moveObjects(gc_heap_t *h) {
+   size_t i = 0, newNextFree = 0, step;
+   Object* o;
+   Object* to;
+   int k = 0;
+   
+   while(i < h->nextFree) {
+      
+      if(k < h->freeHoles.num && i == h->freeHoles.holes[k].start) {
+         i = h->freeHoles.holes[k++].end;
+         continue;
+      }
+      
+      o = (Object*) (h->heap + i);
+      
+      if(o == NULL) {
+         break;
+      }
+      
+      step = objectSize(o);
+      
+      if(o->marked == 1) {
+         /* source and destination overlap when sliding by less than step */
+         to = o->forwarded;
+         if(to != o) {
+            memmove(to, o, step);
+            h->stats.bytes_copied += step;
+         }
+         newNextFree = (void*)to - h->heap + step;
+         to->marked = 0;
+         to->forwarded = NULL;
+      }
+      
+      i += step;
+   }
+   
+   swapHoles(h);
+   h->nextFree = newNextFree;
+  
+}
+#endif
+
+/* lay the marked objects out in traversal order from the roots. They are
+ * copied into a scratch buffer, leaving the new address behind in the old
+ * copy, and the buffer is copied back over the heap once every pointer in
+ * it has been redirected. collect() allocates the buffer. */
+void evacuateLive(gc_heap_t *h) {
+   size_t scan;
+   int i;
+   
+   h->scratchUsed = 0;
+   
+   for (i = 0; i < *h->rp; i++) {
+      *h->roots[i] = relocate(h, *h->roots[i]);
+   }
+   relocateReferences(h);
+   
+   /* breadth first: the copies themselves are the queue of objects to scan */
+   for(scan = 0; h->collectOrder == GC_ORDER_BFS && scan < h->scratchUsed; 
+         scan += objectSize(h->scratch + scan)) {
+      scanCopy(h, h->scratch + scan);
+   }
+   
+   memcpy(h->heap, h->scratch, h->scratchUsed);
+   h->stats.bytes_copied += h->scratchUsed;
+   h->freeHoles.num = 0;
+   indexHoles(h);
+#ifdef GC_COMPACT_HEADERS
+   memset(h->markBits, 0, (GRANULES(h->nextFree) / BITS_PER_WORD + 1) * sizeof(uint64_t));
+#endif
+   h->nextFree = h->scratchUsed;
+   free(h->scratch);
+   h->scratch = NULL;
+}
+
+/* copy a marked object to the end of the scratch buffer unless already
+ * there; returns where it will live once the buffer is copied back */
+Object *evacuate(gc_heap_t *h, Object* obj) {
+   size_t step;
+   Object* copy;
+   Object* to;
+   
+   if(obj == NULL || (void*)obj < h->heap || (void*)obj > h->heap + h->heapSize) {
+      return obj;
+   }
+   
+#ifdef GC_COMPACT_HEADERS
+   /* the old copy loses its mark once evacuated and its class slot then
+    * holds the new address */
+   if(!isMarked(h, obj)) {
+      return gc_heap_load(h, obj->class_id);
+   }
+#else
+   if(obj->forwarded != NULL) {
+      return obj->forwarded;
+   }
+#endif
+   
+   step = objectSize(obj);
+   copy = (Object*) (h->scratch + h->scratchUsed);
+   to = (Object*) (h->heap + h->scratchUsed);
+   memcpy(copy, obj, step);
+   h->scratchUsed += step;
+   
+#ifdef GC_COMPACT_HEADERS
+   h->markBits[GRANULES((void*)obj - h->heap) / BITS_PER_WORD] &= 
+         ~((uint64_t) 1 << (GRANULES((void*)obj - h->heap) % BITS_PER_WORD));
+   obj->class_id = gc_heap_store(h, to);
+#else
+   obj->forwarded = to;
+   obj->marked = 0;
+   copy->marked = 0;
+#endif
+   
+   if(h->collectOrder == GC_ORDER_DFS) {
+      scanCopy(h, copy);
+   }
+   return to;
+}
+
+/* evacuate everything a copy points at and redirect its fields */
+void scanCopy(gc_heap_t *h, Object* copy) {
+   int i;
+   ClassDescriptor *class = classOf(copy);
+   
+   for(i = 0; i < class->num_fields; i++) {
+      setField(h, copy, class->field_offsets[i], 
+            evacuate(h, getField(h, copy, class->field_offsets[i])));
+   }
+   if(class == &WeakRef_class) {
+      setField(h, copy, REFERENT, evacuate(h, getField(h, copy, REFERENT)));
+   }
+}
+
+ClassDescriptor WeakRef_class = {
+    "WeakRef",
+    sizeof (struct WeakRef),
+    0, /* the referent is deliberately not a traced field */
+    NULL
+};
+
+/* allocate a weak reference to referent */
+WeakRef *gc_heap_alloc_weak(gc_heap_t *h, Object *referent) {
+   WeakRef* ref;
+   gc_heap_save_rp(h);
+   
+   gc_heap_add_root(h, referent); /* allocating may collect and move it */
+   ref = (WeakRef*) gc_heap_alloc(h, &WeakRef_class);
+   gc_heap_restore_roots(h);
+   if(ref != NULL) {
+      setField(h, (Object*) ref, REFERENT, referent);
+   }
+   return ref;
+}
+
+/* the referent, or NULL once it has been collected */
+Object *gc_heap_weak_get(gc_heap_t *h, WeakRef *ref) {
+   return getField(h, (Object*) ref, REFERENT);
+}
+
+gc_weak_table *gc_heap_weak_table_new(gc_heap_t *h) {
+   gc_weak_table *table = calloc(1, sizeof(gc_weak_table));
+   
+   table->capacity = 16;
+   table->keys = calloc(table->capacity, sizeof(Object*));
+   table->values = calloc(table->capacity, sizeof(Object*));
+   table->owner = h;
+   table->next = h->weakTables;
+   h->weakTables = table;
+   return table;
+}
+
+void gc_weak_table_free(gc_weak_table *table) {
+   gc_weak_table **t;
+   
+   for(t = table->owner ? &table->owner->weakTables : NULL; t != NULL && *t != NULL; 
+         t = &(*t)->next) {
+      if(*t == table) {
+         *t = table->next;
+         break;
+      }
+   }
+   free(table->keys);
+   free(table->values);
+   free(table);
+}
+
+/* slot holding key, or the empty slot where it would go */
+int tableSlot(gc_weak_table *table, Object *key) {
+   int i = (int) (((size_t) key >> 3) * 2654435761u) & (table->capacity - 1);
+   
+   while(table->keys[i] != NULL && table->keys[i] != key) {
+      i = (i + 1) & (table->capacity - 1);
+   }
+   return i;
+}
+
+void tableInsert(gc_weak_table *table, Object *key, Object *value) {
+   int i = tableSlot(table, key);
+   
+   if(table->keys[i] == NULL) {
+      table->keys[i] = key;
+      table->size++;
+   }
+   table->values[i] = value;
+}
+
+/* rebuild at the keys' current addresses, dropping cleared entries and
+ * growing so the table stays at most half full */
+void rehashTable(gc_weak_table *table) {
+   Object **keys = table->keys;
+   Object **values = table->values;
+   int i, capacity = table->capacity, live = 0;
+   
+   for(i = 0; i < capacity; i++) {
+      live += keys[i] != NULL;
+   }
+   while(table->capacity < 2 * (live + 1)) {
+      table->capacity *= 2;
+   }
+   table->keys = calloc(table->capacity, sizeof(Object*));
+   table->values = calloc(table->capacity, sizeof(Object*));
+   table->size = 0;
+   for(i = 0; i < capacity; i++) {
+      if(keys[i] != NULL) {
+         tableInsert(table, keys[i], values[i]);
+      }
+   }
+   free(keys);
+   free(values);
+}
+
+/* NULL marks an empty slot, so a NULL key is never stored */
+void gc_weak_table_put(gc_weak_table *table, Object *key, Object *value) {
+   if(key == NULL) {
+      return;
+   }
+   if(2 * (table->size + 1) > table->capacity) {
+      rehashTable(table);
+   }
+   tableInsert(table, key, value);
+}
+
+Object *gc_weak_table_get(gc_weak_table *table, Object *key) {
+   return key == NULL ? NULL : table->values[tableSlot(table, key)];
+}
+
+int gc_weak_table_size(gc_weak_table *table) {
+   return table->size;
+}
+
+/* call finalize once obj becomes unreachable; it is kept alive until
+ * gc_run_finalizers() runs it */
+void gc_heap_register_finalizer(gc_heap_t *h, Object *obj, void (*finalize)(Object *obj)) {
+   if(h->numFinalizers == h->maxFinalizers) {
+      h->maxFinalizers = h->maxFinalizers == 0 ? 16 : 2 * h->maxFinalizers;
+      h->finalizers = realloc(h->finalizers, h->maxFinalizers * sizeof(Finalizer));
+   }
+   h->finalizers[h->numFinalizers].obj = obj;
+   h->finalizers[h->numFinalizers].finalize = finalize;
+   h->numFinalizers++;
+}
+
+/* run the finalizers of objects found unreachable, outside of any collection.
+ * The object is rooted while its finalizer runs, but like any local the
+ * finalizer's argument must be rooted by the finalizer itself if it
+ * allocates. */
+void gc_heap_run_finalizers(gc_heap_t *h) {
+   Finalizer f;
+   
+   while(h->numPending > 0) {
+      f = h->pending[--h->numPending];
+      gc_heap_save_rp(h);
+      gc_heap_add_root(h, f.obj);
+      f.finalize(f.obj);
+      gc_heap_restore_roots(h);
+   }
+}
+
+/* free the heap */
+void gc_done() {
+   freeHeap(&defaultHeap);
+}
+
+void gc_heap_done(gc_heap_t *h) {
+   freeHeap(h);
+   free(h);
+}
+
+void freeHeap(gc_heap_t *h) {
+   gc_weak_table *t;
+   
+   /* tables outlive the heap until gc_weak_table_free() */
+   for(t = h->weakTables; t != NULL; t = t->next) {
+      t->owner = NULL;
+   }
+   if(h->heap != NULL) {
+      munmap(h->heap, h->heapMapped);
+   }
+   free(h->discovered);
+   free(h->finalizers);
+   free(h->pending);
+   free(h->pins);
+   free(h->freeHoles.holes);
+   free(h->nextHoles.holes);
+   h->discovered = NULL;
+   h->finalizers = h->pending = NULL;
+   h->pins = NULL;
+   h->numPins = h->maxPins = 0;
+   memset(&h->freeHoles, 0, sizeof(HoleList));
+   memset(&h->nextHoles, 0, sizeof(HoleList));
+   h->numDiscovered = h->maxDiscovered = 0;
+   h->numFinalizers = h->maxFinalizers = h->numPending = h->maxPending = 0;
+#ifdef GC_COMPACT_HEADERS
+   free(h->markBits);
+#endif
+}
+
+/* room for size bytes, collecting if there is none */
+void *allocate(gc_heap_t *h, size_t size) {
+   void *p = takeSpace(h, size);
+   int compacted;
+   
+   if(p == NULL) {
+      compacted = collect(h, 0);
+      p = takeSpace(h, size);
+      if(p == NULL && !compacted) {
+         /* sweeping left no hole big enough; squeeze the holes out */
+         collect(h, 1);
+         p = takeSpace(h, size);
+      }
+      if(p == NULL && h->softLimit < h->heapSize) {
+         /* the goal cannot be met; use the whole heap rather than fail */
+         h->softLimit = h->heapSize;
+         p = takeSpace(h, size);
+      }
+      if(p == NULL) {
+         printf("No more space after garbage collection.");
+      }
+   }
+   VERIFY(verifyFresh(h, p, size));
+   return p;
+}
+
+/* the smallest hole size bytes fit in, else the end of the heap. Any
+ * hole of size's own class fits unless the class is a range of sizes, in
+ * which case only its first hole is tried; any hole of a larger class fits. */
+void *takeSpace(gc_heap_t *h, size_t size) {
+   Hole *hole;
+   void *p;
+   int c = holeClass(size), k = h->holeClasses[c] - 1;
+   
+   if(k < 0 || h->freeHoles.holes[k].end - h->freeHoles.holes[k].start < size) {
+      c = holeClassFrom(h, c + 1);
+      k = c >= 0 ? h->holeClasses[c] - 1 : -1;
+   }
+   if(k >= 0) {
+      hole = &h->freeHoles.holes[k];
+      h->holeClasses[c] = hole->next;
+      if(hole->next == 0) {
+         h->holeClassMask[c / 64] &= ~((uint64_t) 1 << c % 64);
+      }
+      p = h->heap + hole->start;
+      hole->start += size;
+      /* a used up hole stays in the list, empty, for heap walks to step over */
+      if(hole->end > hole->start) {
+         fileHole(h, k);
+      }
+      h->allocatedBytes += size;
+      return p;
+   }
+   
+   if(h->nextFree + size > h->softLimit) {
+      return NULL;
+   }
+   p = h->heap + h->nextFree;
+   h->nextFree += size;
+   h->allocatedBytes += size;
+   return p;
+}
+
+void addHole(HoleList *list, size_t start, size_t end) {
+   if(list->num == list->max) {
+      list->max = list->max == 0 ? 16 : 2 * list->max;
+      list->holes = realloc(list->holes, list->max * sizeof(Hole));
+   }
+   list->holes[list->num].start = start;
+   list->holes[list->num].end = end;
+   list->holes[list->num].next = 0;
+   list->num++;
+}
+
+#define SMOOTH(avg, sample) ((avg) == 0 ? (sample) : ((avg) + (sample)) / 2)
+
+/* record what the collection that just found used bytes in use measured and
+ * pick the soft limit that triggers the next one. With live bytes surviving,
+ * a collection at limit L takes about pausePerByte * L and follows
+ * (L - live) / allocRate seconds of mutator time. */
+void sizeHeap(gc_heap_t *h, size_t used, double pause, double mutatorTime) {
+   size_t live = h->markedBytes, limit, top, page = sysconf(_SC_PAGESIZE);
+   double ratio, target = h->heapSize;
+   
+   h->stats.gc_seconds += pause;
+   h->stats.longest_pause = pause > h->stats.longest_pause ? pause : h->stats.longest_pause;
+   h->survival = SMOOTH(h->survival, used > 0 ? (double) live / used : 1);
+   if(mutatorTime > 0 && h->allocatedBytes > 0) {
+      h->allocRate = SMOOTH(h->allocRate, h->allocatedBytes / mutatorTime);
+   }
+   if(used > 0) {
+      h->pausePerByte = SMOOTH(h->pausePerByte, pause / used);
+   }
+   h->allocatedBytes = 0;
+   h->lastCollection = seconds();
+   if(used > h->heapTop) {
+      h->heapTop = used;
+   }
+   
+   if(h->goal == GC_GOAL_THROUGHPUT && h->goalValue > 0 && h->goalValue < 1) {
+      /* the collector's share pausePerByte * L / (pausePerByte * L +
+       * (L - live) / allocRate) is the goal at L = live / (1 - ratio) */
+      ratio = h->allocRate * h->pausePerByte * (1 - h->goalValue) / h->goalValue;
+      target = ratio < 1 ? live / (1 - ratio) : h->heapSize;
+   } else if(h->goal == GC_GOAL_PAUSE && h->pausePerByte > 0) {
+      target = h->goalValue / 1000 / h->pausePerByte;
+   }
+   
+   /* a goal the live data alone rules out cannot be worth collecting more
+    * often than once per its own size of allocation */
+   limit = h->nextFree + (live > h->heapSize / 64 ? live : h->heapSize / 64);
+   if(target > limit) {
+      limit = target < h->heapSize ? (size_t) target : h->heapSize;
+   }
+   h->softLimit = limit < h->heapSize ? limit & ~((size_t) GC_ALIGNMENT - 1) : h->heapSize;
+   
+   /* give back the pages above the limit until it grows again; the last
+    * page is dropped whole, so it is poisoned again whole */
+   limit = (h->softLimit + page - 1) & ~(page - 1);
+   top = (h->heapTop + page - 1) & ~(page - 1);
+   if(limit < top) {
+      madvise(h->heap + limit, top - limit, MADV_DONTNEED);
+      VERIFY(memset(h->heap + limit, POISON, top - limit));
+      h->heapTop = limit;
+   }
+}
+
+double seconds() {
+   struct timespec ts;
+   
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* the holes the finished compaction left replace the ones it filled */
+void swapHoles(gc_heap_t *h) {
+   HoleList filled = h->freeHoles;
+   
+   h->freeHoles = h->nextHoles;
+   h->nextHoles = filled;
+   h->nextHoles.num = 0;
+   indexHoles(h);
+}
+
+/* file hole k at the head of the list for its size class */
+void fileHole(gc_heap_t *h, int k) {
+   Hole *hole = &h->freeHoles.holes[k];
+   int c = holeClass(hole->end - hole->start);
    
-   if(obj == NULL || obj->marked == 1 || (void*)obj < heap || 
-         (void*)obj > heap + heapSize) {
-      return;
+   hole->next = h->holeClasses[c];
+   h->holeClasses[c] = k + 1;
+   h->holeClassMask[c / 64] |= (uint64_t) 1 << c % 64;
+}
+
+int holeClass(size_t size) {
+   size_t granules = size / GC_ALIGNMENT;
+   
+   if(granules < SMALL_HOLE) {
+      return granules;
    }
+   return SMALL_HOLE + (63 - __builtin_clzll(granules)) - __builtin_ctz(SMALL_HOLE);
+}
+
+/* the first class from c on with a hole, -1 if none */
+int holeClassFrom(gc_heap_t *h, int c) {
+   uint64_t bits;
+   int w;
    
-   obj->marked = 1;
-      
-   for(i = 0; i < obj->class->num_fields; i++) {
-      
-      field = ((Object**) (obj->class->field_offsets[i] + (void*)obj));
-      
-      if(*field == NULL) {
-         continue;
+   for(w = c / 64; w < HOLE_CLASSES / 64; w++) {
+      bits = h->holeClassMask[w] & (w == c / 64 ? ~(uint64_t) 0 << c % 64 : ~(uint64_t) 0);
+      if(bits != 0) {
+         return w * 64 + __builtin_ctzll(bits);
       }
-      changePointers(*field); 
-      *field = (*field)->forwarded;
    }
+   return -1;
 }
 
-/* move objects */
-void moveObjects() {
-   int i = 0, newNextFree = 0, step;
-   Object* o;
+/* rebuild the size class lists, lowest addresses first within each */
+void indexHoles(gc_heap_t *h) {
+   int k;
    
-   while(i < nextFree) {
-      
-      o = (Object*) (heap + i);
-      
-      if(o == NULL) {
-         break;
-      }
-      
-      if(strcmp("String", (char*)(o->class->name)) == 0) {
-         step = ((String*)o)->length + String_class.size;
-      } else {
-         step = o->class->size;
-      }
-      
-      if(o->marked == 1) {
-         memcpy(o->forwarded, o, step);
-         newNextFree += step;
-         o->marked = 0;
-         o->forwarded = NULL;
+   memset(h->holeClasses, 0, sizeof(h->holeClasses));
+   memset(h->holeClassMask, 0, sizeof(h->holeClassMask));
+   for(k = h->freeHoles.num - 1; k >= 0; k--) {
+      if(h->freeHoles.holes[k].end > h->freeHoles.holes[k].start) {
+         fileHole(h, k);
       }
-      
-      i += step;
    }
+}
+
+/* keep obj alive and at its address until the matching gc_unpin(), e.g.
+ * while the kernel reads into or writes from it */
+void gc_heap_pin(gc_heap_t *h, Object *obj) {
+   int p = 0;
    
-   nextFree = newNextFree;
-  
+   while(p < h->numPins && h->pins[p].obj < obj) {
+      p++;
+   }
+   if(p < h->numPins && h->pins[p].obj == obj) {
+      h->pins[p].count++;
+      return;
+   }
+   if(h->numPins == h->maxPins) {
+      h->maxPins = h->maxPins == 0 ? 16 : 2 * h->maxPins;
+      h->pins = realloc(h->pins, h->maxPins * sizeof(Pin));
+   }
+   memmove(&h->pins[p + 1], &h->pins[p], (h->numPins - p) * sizeof(Pin));
+   h->pins[p].obj = obj;
+   h->pins[p].count = 1;
+   h->numPins++;
 }
 
-/* free the heap */
-void gc_done() {
-   free(heap);
+void gc_heap_unpin(gc_heap_t *h, Object *obj) {
+   int p;
+   
+   for(p = 0; p < h->numPins; p++) {
+      if(h->pins[p].obj == obj) {
+         if(--h->pins[p].count == 0) {
+            memmove(&h->pins[p], &h->pins[p + 1], (h->numPins - p - 1) * sizeof(Pin));
+            h->numPins--;
+         }
+         return;
+      }
+   }
 }
 
 /* allocate an object */
-Object *gc_alloc(ClassDescriptor *class) {
-   int old_offset;
+Object *gc_heap_alloc(gc_heap_t *h, ClassDescriptor *class) {
    int i;
    Object* o;
    
-   if(nextFree + class->size > heapSize) {
-      gc();
-      if(nextFree + class->size > heapSize) {
-         printf("No more space after garbage collection.");
-         return NULL;
-      }
+   if(__atomic_load_n(&class->id, __ATOMIC_ACQUIRE) == 0 && !registerClass(class)) {
+      return NULL;
    }
-   old_offset = nextFree;
-   
-   nextFree += class->size;
-   o = (Object*) (old_offset + heap);
+   o = (Object*) allocate(h, GC_ALIGN(class->size));
+   if(o == NULL) {
+      return NULL;
+   }
+#ifdef GC_COMPACT_HEADERS
+   o->class_id = class->id;
+#else
    o->class = class;
    o->forwarded = NULL;
    o->marked = 0;
+#endif
    
    /* force all object pointer fields to be null */
-   for(i = 0; i < o->class->num_fields; i++) {
-      *( (Object**) (o->class->field_offsets[i] + (void*)o) ) = NULL; 
-      
+   for(i = 0; i < class->num_fields; i++) {
+      setField(h, o, class->field_offsets[i], NULL);
    }
    
    return o;
@@ -207,65 +1466,76 @@ ClassDescriptor String_class = {
 };
 
 /* allocate a string */
-String *gc_alloc_string(int size) {
-   int old_offset;
+String *gc_heap_alloc_string(gc_heap_t *h, size_t size) {
    String* s;
    
-   if(nextFree + String_class.size + size + 1 > heapSize) {
-      gc();
-      if(nextFree + String_class.size + size + 1 > heapSize) {
-         printf("No more space after garbage collection.");
-         return NULL;
-      }
+   if(__atomic_load_n(&String_class.id, __ATOMIC_ACQUIRE) == 0 && 
+         !registerClass(&String_class)) {
+      return NULL;
+   }
+   if(size > MAX_STRING) {
+      printf("Strings limited to %zu bytes.", (size_t) MAX_STRING);
+      return NULL;
+   }
+   s = (String*) allocate(h, GC_ALIGN(String_class.size + size + 1));
+   if(s == NULL) {
+      return NULL;
    }
    
-   old_offset = nextFree;
-   
-   nextFree += String_class.size + size + 1;
-   s = (String*) (old_offset + heap);
-   s->class = &String_class;
    s->length = size+1;
+#ifdef GC_COMPACT_HEADERS
+   s->class_id = String_class.id;
+#else
+   s->class = &String_class;
    s->forwarded = NULL;
    s->marked = 0;
+#endif
 
    return s;
 }
 
 /* dumps the heap */
-char *gc_get_state() {
+char *gc_heap_get_state(gc_heap_t *h) {
    char* buf = calloc(1024, sizeof(char));
    Object* obj;
-   int i = 0, 
+   size_t i = 0, 
    offset = 0;
-   int step;
-   Object** field;
+   size_t step;
+   ClassDescriptor *class;
+   int k = 0;
    
-   sprintf(buf, "next_free=%d\nobjects:\n", nextFree);
+   sprintf(buf, "next_free=%zu\nobjects:\n", h->nextFree);
    
-   while(i < nextFree) {
+   while(i < h->nextFree) {
+      
+      if(k < h->freeHoles.num && i == h->freeHoles.holes[k].start) {
+         if(h->freeHoles.holes[k].end > i) {
+            sprintf(buf + strlen(buf), "  %04zu:hole[%zu]\n", i, h->freeHoles.holes[k].end - i);
+         }
+         i = h->freeHoles.holes[k++].end;
+         continue;
+      }
       
-      obj = (Object*) (heap + i);
+      obj = (Object*) (h->heap + i);
       if(obj == NULL) {
          break;
       }
       
-      offset = (void*)obj - heap;
+      offset = (void*)obj - h->heap;
       
-      sprintf(buf, "%s  %04d:%s[", buf, offset, obj->class->name);
+      class = classOf(obj);
+      sprintf(buf, "%s  %04zu:%s[", buf, offset, class->name);
+      step = objectSize(obj);
       
       /* string */
-      if(strcmp(obj->class->name, "String") == 0) {
-         step = ((String*)obj)->length + String_class.size;
-         
-         sprintf(buf, "%s%d+%d]=\"%s\"\n", buf, String_class.size, ((String*) obj)->length, ((String*) obj)->str);
+      if(class == &String_class) {
+         sprintf(buf, "%s%zu+%zu]=\"%s\"\n", buf, String_class.size, (size_t) ((String*) obj)->length, ((String*) obj)->str);
       } 
       else { /* object */
-         step = obj->class->size;
-         sprintf(buf, "%s%d]->[", buf, step);
-         field = NULL;
+         sprintf(buf, "%s%zu]->[", buf, class->size);
         
          /* get info on every field object */
-         buf = doFields(obj, buf);
+         buf = doFields(h, obj, buf);
          
          sprintf(buf, "%s]\n", buf);
       }
@@ -276,75 +1546,729 @@ char *gc_get_state() {
    
 }
 
+int gc_heap_num_roots(gc_heap_t *h) {
+   return *h->rp;
+}
+
+/* what gc_heap_add_root() expands to */
+void gc_heap_push_root(gc_heap_t *h, Object **root) {
+   h->roots[(*h->rp)++] = root;
+}
+
+/* forget the roots added since there were num */
+void gc_heap_pop_roots(gc_heap_t *h, int num) {
+   *h->rp = num;
+}
+
+/* bytes between the start of the heap and the next free byte */
+size_t gc_heap_used(gc_heap_t *h) {
+   return h->nextFree;
+}
+
+/* the original single heap API works on the default heap */
+void gc() {
+   gc_heap_collect(&defaultHeap);
+}
+
+Object *gc_alloc(ClassDescriptor *class) {
+   return gc_heap_alloc(&defaultHeap, class);
+}
+
+String *gc_alloc_string(size_t size) {
+   return gc_heap_alloc_string(&defaultHeap, size);
+}
+
+char *gc_get_state() {
+   return gc_heap_get_state(&defaultHeap);
+}
+
 int gc_num_roots() {
-   return _rp;
+   return gc_heap_num_roots(&defaultHeap);
 }
 
-char *doFields(Object* obj, char* buf) {
-   Object** field;
+size_t gc_used() {
+   return gc_heap_used(&defaultHeap);
+}
+
+void gc_set_compaction_order(int order) {
+   gc_heap_set_compaction_order(&defaultHeap, order);
+}
+
+void gc_set_compaction_threshold(double fraction) {
+   gc_heap_set_compaction_threshold(&defaultHeap, fraction);
+}
+
+void gc_get_stats(gc_stats *stats) {
+   gc_heap_get_stats(&defaultHeap, stats);
+}
+
+void gc_set_goal(int goal, double value) {
+   gc_heap_set_goal(&defaultHeap, goal, value);
+}
+
+WeakRef *gc_alloc_weak(Object *referent) {
+   return gc_heap_alloc_weak(&defaultHeap, referent);
+}
+
+Object *gc_weak_get(WeakRef *ref) {
+   return gc_heap_weak_get(&defaultHeap, ref);
+}
+
+gc_weak_table *gc_weak_table_new() {
+   return gc_heap_weak_table_new(&defaultHeap);
+}
+
+void gc_register_finalizer(Object *obj, void (*finalize)(Object *obj)) {
+   gc_heap_register_finalizer(&defaultHeap, obj, finalize);
+}
+
+void gc_run_finalizers() {
+   gc_heap_run_finalizers(&defaultHeap);
+}
+
+void gc_pin(Object *obj) {
+   gc_heap_pin(&defaultHeap, obj);
+}
+
+void gc_unpin(Object *obj) {
+   gc_heap_unpin(&defaultHeap, obj);
+}
+
+char *doFields(gc_heap_t *h, Object* obj, char* buf) {
+   Object* field;
+   ClassDescriptor *class = classOf(obj);
    int j;
 
-   for(j = 0; j < obj->class->num_fields; j++) {
+   for(j = 0; j < class->num_fields; j++) {
        
-      field = ((Object**) (obj->class->field_offsets[j] + (void*)obj)); 
+      field = getField(h, obj, class->field_offsets[j]); 
       
       if(j != 0) {
          sprintf(buf, "%s,", buf);
       }
       
-      if(*field == NULL) {
+      if(field == NULL) {
          sprintf(buf, "%sNULL", buf);
       } else {
-         sprintf(buf, "%s%ld", buf, ((void*)(*field))-heap);
+         sprintf(buf, "%s%ld", buf, ((void*)field)-h->heap);
       }
       
     }
+   
+   /* show where a weak ref points too, though it is not a traced field */
+   if(class == &WeakRef_class) {
+      field = getField(h, obj, REFERENT);
+      if(field == NULL) {
+         strcat(buf, "NULL");
+      } else {
+         sprintf(buf + strlen(buf), "%ld", ((void*)field)-h->heap);
+      }
+   }
    return buf;
 }
 
 
-char *printObjectsFromRoots() {
+char *printObjectsFromRoots(gc_heap_t *h) {
    char* buf = calloc(1024, sizeof(char));
    Object* obj;
-   int i, j, offset;
+   int i, j;
+   size_t offset;
    char* objName;
-   int objSize;
+   size_t objSize;
    void* addr;
+   ClassDescriptor *class;
    
-   sprintf(buf, "next_free=%d\nobjects:\n", nextFree);
+   sprintf(buf, "next_free=%zu\nobjects:\n", h->nextFree);
 
    /* get info on every root */
-   for (i = 0; i < _rp; i++) { 
-      obj = *_roots[i];
+   for (i = 0; i < *h->rp; i++) { 
+      obj = *h->roots[i];
       if(obj == NULL) {
          continue;
       }
       
-      objName = obj->class->name;
-      offset = (void*)obj - heap;
+      class = classOf(obj);
+      objName = class->name;
+      offset = (void*)obj - h->heap;
       
-      sprintf(buf, "%s  %04d:%s[", buf, offset, objName);
+      sprintf(buf, "%s  %04zu:%s[", buf, offset, objName);
       
       /* string */
       if(strcmp(objName, "String") == 0) {
          objSize = ((String*) obj)->length + 1;
-         sprintf(buf, "%s%d+%d]=\"%s\"\n", buf, String_class.size, objSize, ((String*) obj)->str);
+         sprintf(buf, "%s%zu+%zu]=\"%s\"\n", buf, String_class.size, objSize, ((String*) obj)->str);
       } 
       else { /* object */
-         objSize = obj->class->size;
-         sprintf(buf, "%s%d]->[", buf, objSize);
+         objSize = class->size;
+         sprintf(buf, "%s%zu]->[", buf, objSize);
          /* get info on every field object */
-         for(j = 0; j < obj->class->num_fields; j++) {
+         for(j = 0; j < class->num_fields; j++) {
             if(j != 0) {
                sprintf(buf, "%s,", buf);
             }
-            addr = obj->class->field_offsets[j] + obj;
-            offset = addr - heap;
-            sprintf(buf, "%s%d", buf, offset);
+            addr = class->field_offsets[j] + obj;
+            offset = addr - h->heap;
+            sprintf(buf, "%s%zu", buf, offset);
          }
          sprintf(buf, "%s]\n", buf);
       }
    }
 	
    return buf;
-}
\ No newline at end of file
+}
+/* An image file is an ImageHeader, the descriptor table of the classes its
+ * objects use, the roots, the relocation map and, at a page aligned offset,
+ * the heap itself. In the saved heap class slots hold the class's image id
+ * and pointers hold their heap offset plus one, 0 being NULL; the relocation
+ * map lists where those slots are. Compressed references are heap offsets
+ * already, so compact images only list class slots. */
+#define IMAGE_MAGIC     "GCIMAGE"
+#define IMAGE_LAYOUT    (GC_ALIGNMENT | COMPACT_LAYOUT)
+#ifdef GC_COMPACT_HEADERS
+#define COMPACT_LAYOUT  0x10000
+#else
+#define COMPACT_LAYOUT  0
+#endif
+/* relocation entries are heap offsets shifted left by one, with this bit
+ * set for class slots */
+#define RELOC_CLASS     1
+
+typedef struct ImageHeader {
+   char magic[8];
+   uint32_t layout;       /* alignment and header layout the heap was saved with */
+   uint32_t numClasses;   /* descriptor table entries */
+   uint32_t numRoots;
+   uint32_t maxClassId;
+   uint64_t used;         /* bytes of heap */
+   uint64_t numRelocs;
+   uint64_t dataOffset;
+} ImageHeader;
+
+/* compact the heap and write it with its roots to path */
+int gc_heap_save_image(gc_heap_t *h, const char *path) {
+   size_t i = 0, step, page = sysconf(_SC_PAGESIZE), numRelocs = 0, maxRelocs = 0;
+   uint64_t *relocs = NULL, root;
+   char *used;
+   void *data;
+   Object *o;
+   ClassDescriptor *class;
+   ImageHeader header;
+   FILE *f = NULL;
+   char *temp = malloc(strlen(path) + 8);
+   int j, c, k, fd, failed, classes, status = GC_IMAGE_OK;
+#ifndef GC_COMPACT_HEADERS
+   Object *field;
+#endif
+   
+   /* other threads may register classes meanwhile; this heap's objects
+    * only use classes registered before now */
+   pthread_mutex_lock(&classLock);
+   classes = numClasses;
+   pthread_mutex_unlock(&classLock);
+   used = calloc(classes, 1);
+   
+   collect(h, 1);
+   for(k = 0; k < h->freeHoles.num; k++) {
+      if(h->freeHoles.holes[k].end > h->freeHoles.holes[k].start) {
+         printf("Cannot save an image of a heap with pinned objects.");
+         free(used);
+         free(temp);
+         return GC_IMAGE_PINNED;
+      }
+   }
+   
+   /* a copy of the heap with classes and pointers made relocatable */
+   data = malloc(h->nextFree + 1);
+   memcpy(data, h->heap, h->nextFree);
+   while(i < h->nextFree) {
+      o = (Object*) (h->heap + i);
+      class = classOf(o);
+      step = objectSize(o);
+      used[class->id] = 1;
+      
+      if(numRelocs + class->num_fields + 2 > maxRelocs) {
+         maxRelocs = 2 * maxRelocs + class->num_fields + 2;
+         relocs = realloc(relocs, maxRelocs * sizeof(uint64_t));
+      }
+#ifdef GC_COMPACT_HEADERS
+      relocs[numRelocs++] = i << 1 | RELOC_CLASS;
+#else
+      *(size_t*) (data + i + offsetof(Object, class)) = class->id;
+      relocs[numRelocs++] = (i + offsetof(Object, class)) << 1 | RELOC_CLASS;
+      for(j = 0; j <= class->num_fields; j++) {
+         if(j == class->num_fields && class != &WeakRef_class) {
+            break;
+         }
+         c = j < class->num_fields ? class->field_offsets[j] : REFERENT;
+         field = getField(h, o, c);
+         if(field != NULL) {
+            *(size_t*) (data + i + c) = (void*)field - h->heap + 1;
+            relocs[numRelocs++] = (i + c) << 1;
+         }
+      }
+#endif
+      i += step;
+   }
+   
+   memcpy(header.magic, IMAGE_MAGIC, sizeof(header.magic));
+   header.layout = IMAGE_LAYOUT;
+   header.numClasses = 0;
+   for(c = 1; c < classes; c++) {
+      header.numClasses += used[c];
+   }
+   header.numRoots = *h->rp;
+   header.maxClassId = classes - 1;
+   header.used = h->nextFree;
+   header.numRelocs = numRelocs;
+   
+   /* written beside path and renamed over it, so processes that have the
+    * old image mapped keep reading the old file */
+   sprintf(temp, "%s.XXXXXX", path);
+   fd = mkstemp(temp);
+   if(fd >= 0) {
+      fchmod(fd, 0644);
+      f = fdopen(fd, "wb");
+   }
+   if(f == NULL) {
+      printf("Cannot create image %s.", path);
+      if(fd >= 0) {
+         close(fd);
+         unlink(temp);
+      }
+      status = GC_IMAGE_IO;
+   } else {
+      fwrite(&header, sizeof(header), 1, f);
+      for(c = 1; c < classes; c++) {
+         if(!used[c]) {
+            continue;
+         }
+         /* id, name, size and field offsets */
+         j = strlen(classTable[c]->name);
+         fwrite(&c, sizeof(int), 1, f);
+         fwrite(&j, sizeof(int), 1, f);
+         fwrite(classTable[c]->name, 1, j, f);
+         fwrite(&classTable[c]->size, sizeof(size_t), 1, f);
+         fwrite(&classTable[c]->num_fields, sizeof(int), 1, f);
+         if(classTable[c]->num_fields > 0) {
+            fwrite(classTable[c]->field_offsets, sizeof(int), classTable[c]->num_fields, f);
+         }
+      }
+      for(j = 0; j < *h->rp; j++) {
+         root = *h->roots[j] == NULL ? 0 : (void*)*h->roots[j] - h->heap + 1;
+         fwrite(&root, sizeof(uint64_t), 1, f);
+      }
+      fwrite(relocs, sizeof(uint64_t), numRelocs, f);
+      
+      /* the heap goes where it can be mapped from */
+      header.dataOffset = (ftell(f) + page - 1) & ~(page - 1);
+      fseek(f, header.dataOffset, SEEK_SET);
+      fwrite(data, 1, h->nextFree, f);
+      rewind(f);
+      fwrite(&header, sizeof(header), 1, f);
+      failed = fflush(f) != 0 || ferror(f);
+      failed = fclose(f) != 0 || failed;
+      if(failed || rename(temp, path) != 0) {
+         printf("Cannot write image %s.", path);
+         unlink(temp);
+         status = GC_IMAGE_IO;
+      }
+   }
+   free(temp);
+   free(data);
+   free(relocs);
+   free(used);
+   return status;
+}
+
+/* the class in classes (NULL terminated) matching an image's descriptor, or
+ * NULL if none has the same name, size and fields */
+ClassDescriptor *imageClass(ClassDescriptor **classes, char *name, size_t size, 
+      int numFields, int *offsets) {
+   ClassDescriptor *builtins[] = {&String_class, &WeakRef_class, NULL};
+   ClassDescriptor **list;
+   ClassDescriptor *c;
+   int i;
+   
+   for(list = builtins; list != NULL; list = list == builtins ? classes : NULL) {
+      for(i = 0; list[i] != NULL; i++) {
+         c = list[i];
+         if(strcmp(c->name, name) == 0 && c->size == size && c->num_fields == numFields &&
+               (numFields == 0 || 
+               memcmp(c->field_offsets, offsets, numFields * sizeof(int)) == 0)) {
+            return c;
+         }
+      }
+   }
+   return NULL;
+}
+
+/* replace the contents of an empty heap with an image saved by
+ * gc_heap_save_image(), setting the roots registered so far, which must be
+ * as many as when it was saved. The heap is mapped copy-on-write from the
+ * file. classes, NULL terminated, are the classes the image may use besides
+ * String and WeakRef. */
+int gc_heap_load_image(gc_heap_t *h, const char *path, ClassDescriptor **classes) {
+   size_t i, page = sysconf(_SC_PAGESIZE), len, size, placed = 0;
+   uint64_t *relocs = NULL, *roots = NULL, off, slot;
+   ClassDescriptor **map = NULL;
+   ImageHeader header;
+   char name[256];
+   int id, nameLen, numFields, offsets[256], status = GC_IMAGE_FORMAT;
+   struct stat st;
+   FILE *f = fopen(path, "rb");
+   
+   if(f == NULL) {
+      printf("Cannot open image %s.", path);
+      return GC_IMAGE_IO;
+   }
+   if(fread(&header, sizeof(header), 1, f) != 1 || 
+         memcmp(header.magic, IMAGE_MAGIC, sizeof(header.magic)) != 0 ||
+         header.layout != IMAGE_LAYOUT) {
+      printf("%s is not an image of this heap layout.", path);
+      goto done;
+   }
+   /* nothing is sized from the header before it is checked against the file */
+   if(fstat(fileno(f), &st) != 0 || header.maxClassId >= MAX_CLASSES ||
+         header.dataOffset > st.st_size || header.used > st.st_size - header.dataOffset ||
+         header.numRelocs > header.dataOffset / sizeof(uint64_t) ||
+         (header.numRoots + header.numRelocs) * sizeof(uint64_t) > header.dataOffset) {
+      printf("%s is truncated or damaged.", path);
+      goto done;
+   }
+   if(h->nextFree != 0 || header.used > h->heapSize) {
+      printf("Image %s needs an empty heap of %zu bytes.", path, (size_t) header.used);
+      status = GC_IMAGE_SPACE;
+      goto done;
+   }
+   if(header.numRoots != *h->rp) {
+      printf("Image %s has %u roots, not %d.", path, header.numRoots, *h->rp);
+      status = GC_IMAGE_ROOTS;
+      goto done;
+   }
+   
+   /* image class id to class of this process */
+   map = calloc(header.maxClassId + 1, sizeof(ClassDescriptor*));
+   if(map == NULL) {
+      printf("Out of memory loading image %s.", path);
+      status = GC_IMAGE_SPACE;
+      goto done;
+   }
+   for(i = 0; i < header.numClasses; i++) {
+      if(fread(&id, sizeof(int), 1, f) != 1 || fread(&nameLen, sizeof(int), 1, f) != 1 ||
+            id <= 0 || id > header.maxClassId || nameLen < 0 || nameLen >= sizeof(name) ||
+            fread(name, 1, nameLen, f) != nameLen || fread(&size, sizeof(size_t), 1, f) != 1 ||
+            fread(&numFields, sizeof(int), 1, f) != 1 || numFields < 0 || numFields > 256 ||
+            fread(offsets, sizeof(int), numFields, f) != numFields) {
+         printf("%s has a damaged class table.", path);
+         goto done;
+      }
+      name[nameLen] = '\0';
+      map[id] = imageClass(classes, name, size, numFields, offsets);
+      if(map[id] == NULL || (map[id]->id == 0 && !registerClass(map[id]))) {
+         printf("Image %s uses class %s, which is not given or has changed.", path, name);
+         status = GC_IMAGE_CLASS;
+         goto done;
+      }
+   }
+   roots = malloc((header.numRoots + 1) * sizeof(uint64_t));
+   relocs = malloc((header.numRelocs + 1) * sizeof(uint64_t));
+   if(roots == NULL || relocs == NULL) {
+      printf("Out of memory loading image %s.", path);
+      status = GC_IMAGE_SPACE;
+      goto done;
+   }
+   if(fread(roots, sizeof(uint64_t), header.numRoots, f) != header.numRoots ||
+         fread(relocs, sizeof(uint64_t), header.numRelocs, f) != header.numRelocs) {
+      printf("%s is truncated.", path);
+      goto done;
+   }
+   for(i = 0; i < header.numRoots; i++) {
+      if(roots[i] > header.used) {
+         printf("%s has a damaged root.", path);
+         goto done;
+      }
+   }
+   
+   /* pages only the relocation pass below writes to stay shared with the file */
+   len = (header.used + page - 1) & ~(page - 1);
+   placed = len;
+   if(header.dataOffset % page != 0 || len == 0 ||
+         mmap(h->heap, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, 
+         fileno(f), header.dataOffset) == MAP_FAILED) {
+      /* saved with a smaller page size; read it instead */
+      if(fseek(f, header.dataOffset, SEEK_SET) != 0 || 
+            fread(h->heap, 1, header.used, f) != header.used) {
+         printf("%s is truncated.", path);
+         goto done;
+      }
+   }
+   
+   for(i = 0; i < header.numRelocs; i++) {
+      off = relocs[i] >> 1;
+      if(off + sizeof(void*) > header.used) {
+         printf("%s has a damaged relocation map.", path);
+         goto done;
+      }
+      slot = *(size_t*) (h->heap + off);
+#ifdef GC_COMPACT_HEADERS
+      slot = *(uint32_t*) (h->heap + off);
+#endif
+      if(relocs[i] & RELOC_CLASS ? 
+            slot > header.maxClassId || map[slot] == NULL : slot > header.used) {
+         printf("%s has a damaged relocation map.", path);
+         goto done;
+      }
+      if(relocs[i] & RELOC_CLASS) {
+#ifdef GC_COMPACT_HEADERS
+         /* the same id in both processes leaves the page untouched */
+         if(slot != map[slot]->id) {
+            *(uint32_t*) (h->heap + off) = map[slot]->id;
+         }
+#else
+         *(ClassDescriptor**) (h->heap + off) = map[slot];
+#endif
+      } else if(slot != 0) {
+         *(void**) (h->heap + off) = h->heap + slot - 1;
+      }
+   }
+   
+   h->nextFree = header.used;
+   for(i = 0; i < header.numRoots; i++) {
+      *h->roots[i] = roots[i] == 0 ? NULL : (Object*) (h->heap + roots[i] - 1);
+   }
+   VERIFY(memset(h->heap + h->nextFree, POISON, len - h->nextFree));
+   VERIFY(verifyHeap(h, "after loading image"));
+   status = GC_IMAGE_OK;
+   
+done:
+   if(status != GC_IMAGE_OK && placed > 0) {
+      /* put back the empty heap the image went over */
+      mmap(h->heap, placed, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED | MAP_ANONYMOUS, -1, 0);
+      VERIFY(memset(h->heap, POISON, placed));
+   }
+   fclose(f);
+   free(map);
+   free(roots);
+   free(relocs);
+   return status;
+}
+
+int gc_save_image(const char *path) {
+   return gc_heap_save_image(&defaultHeap, path);
+}
+
+int gc_load_image(const char *path, ClassDescriptor **classes) {
+   return gc_heap_load_image(&defaultHeap, path, classes);
+}
+
+#ifdef GC_VERIFY
+/* check everything a collection relies on: the holes are sorted free space
+ * that still holds the poison, every object has a registered class and fits
+ * below nextFree, no mark or forwarding state is left over, and every field
+ * and root is NULL or the start of an object */
+void verifyHeap(gc_heap_t *h, const char *when) {
+   char *starts = calloc(h->nextFree / GC_ALIGNMENT + 1, 1);
+   size_t i = 0, step, prevEnd = 0;
+   int k, j;
+   Object *o;
+   ClassDescriptor *class;
+   gc_weak_table *t;
+#ifndef GC_COMPACT_HEADERS
+   int c;
+#endif
+   
+   if(h->nextFree > h->heapSize) {
+      verifyFailed(when, "next_free %zu beyond heap size %zu", h->nextFree, h->heapSize);
+   }
+   for(k = 0; k < h->freeHoles.num; k++) {
+      if(h->freeHoles.holes[k].start < prevEnd || 
+            h->freeHoles.holes[k].end < h->freeHoles.holes[k].start ||
+            h->freeHoles.holes[k].end > h->nextFree) {
+         verifyFailed(when, "hole %d [%zu, %zu) out of order", k, 
+               h->freeHoles.holes[k].start, h->freeHoles.holes[k].end);
+      }
+      checkPoison(h, h->freeHoles.holes[k].start, h->freeHoles.holes[k].end, when);
+      prevEnd = h->freeHoles.holes[k].end;
+   }
+   checkPoison(h, h->nextFree, h->heapSize, when);
+   
+   k = 0;
+   while(i < h->nextFree) {
+      
+      if(k < h->freeHoles.num && i == h->freeHoles.holes[k].start) {
+         i = h->freeHoles.holes[k++].end;
+         continue;
+      }
+      if(k < h->freeHoles.num && i > h->freeHoles.holes[k].start) {
+         verifyFailed(when, "object before %zu overlaps hole at %zu", i, 
+               h->freeHoles.holes[k].start);
+      }
+      
+      o = (Object*) (h->heap + i);
+#ifdef GC_COMPACT_HEADERS
+      if(o->class_id == 0 || o->class_id >= numClasses) {
+         verifyFailed(when, "object at %zu has class id %u", i, o->class_id);
+      }
+      if(isMarked(h, o)) {
+         verifyFailed(when, "object at %zu still marked", i);
+      }
+#else
+      for(c = 1; c < numClasses && classTable[c] != o->class; c++);
+      if(c >= numClasses) {
+         verifyFailed(when, "object at %zu has unknown class %p", i, (void*) o->class);
+      }
+      if(o->marked || o->forwarded != NULL) {
+         verifyFailed(when, "object at %zu still marked or forwarded", i);
+      }
+#endif
+      step = objectSize(o);
+      if(step == 0 || i + step > h->nextFree) {
+         verifyFailed(when, "object at %zu of %zu bytes runs past next_free %zu", 
+               i, step, h->nextFree);
+      }
+      starts[i / GC_ALIGNMENT] = 1;
+      i += step;
+   }
+   
+   /* with every object start known, check what points at them */
+   i = k = 0;
+   while(i < h->nextFree) {
+      
+      if(k < h->freeHoles.num && i == h->freeHoles.holes[k].start) {
+         i = h->freeHoles.holes[k++].end;
+         continue;
+      }
+      
+      o = (Object*) (h->heap + i);
+      class = classOf(o);
+      for(j = 0; j < class->num_fields; j++) {
+         verifyRef(h, getField(h, o, class->field_offsets[j]), starts, when, class->name);
+      }
+      if(class == &WeakRef_class) {
+         verifyRef(h, getField(h, o, REFERENT), starts, when, class->name);
+      }
+      i += objectSize(o);
+   }
+   
+   for(j = 0; j < *h->rp; j++) {
+      verifyRef(h, *h->roots[j], starts, when, "root");
+   }
+   for(j = 0; j < h->numPins; j++) {
+      verifyRef(h, h->pins[j].obj, starts, when, "pin");
+   }
+   for(j = 0; j < h->numFinalizers; j++) {
+      verifyRef(h, h->finalizers[j].obj, starts, when, "finalizer");
+   }
+   for(j = 0; j < h->numPending; j++) {
+      verifyRef(h, h->pending[j].obj, starts, when, "pending finalizer");
+   }
+   for(t = h->weakTables; t != NULL; t = t->next) {
+      for(j = 0; j < t->capacity; j++) {
+         verifyRef(h, t->keys[j], starts, when, "weak table key");
+         verifyRef(h, t->values[j], starts, when, "weak table value");
+      }
+   }
+#ifdef GC_COMPACT_HEADERS
+   /* mark bits above next_free must be clear too */
+   for(i = GRANULES(h->nextFree) / BITS_PER_WORD; i < GRANULES(h->heapSize) / BITS_PER_WORD + 1; i++) {
+      if(h->markBits[i] != 0) {
+         verifyFailed(when, "stray mark bits in word %zu", i);
+      }
+   }
+#endif
+   free(starts);
+}
+
+/* sliding keeps survivors in address order: each one moves down, to or
+ * past the end of the one before it, and pinned ones stay put */
+void verifyForwarding(gc_heap_t *h) {
+   size_t i = 0, step, lowest = 0, to;
+   Object *o;
+   int k = 0, p = 0;
+   
+   while(i < h->nextFree) {
+      
+      if(k < h->freeHoles.num && i == h->freeHoles.holes[k].start) {
+         i = h->freeHoles.holes[k++].end;
+         continue;
+      }
+      
+      o = (Object*) (h->heap + i);
+      step = objectSize(o);
+#ifdef GC_COMPACT_HEADERS
+      if(isMarked(h, o)) {
+#else
+      /* setForwarding() has cleared the marks; only live objects are forwarded */
+      if(o->forwarded != NULL) {
+#endif
+         to = (void*)forwardingOf(h, o) - h->heap;
+         if(to > i || to < lowest || to % GC_ALIGNMENT != 0) {
+            verifyFailed("while compacting", "object at %zu forwarded to %zu, "
+                  "expected %zu..%zu", i, to, lowest, i);
+         }
+         for(; p < h->numPins && (void*)h->pins[p].obj < (void*)o; p++);
+         if(p < h->numPins && h->pins[p].obj == o && to != i) {
+            verifyFailed("while compacting", "pinned object at %zu forwarded to %zu", i, to);
+         }
+         lowest = to + step;
+      }
+      i += step;
+   }
+}
+
+void verifyRef(gc_heap_t *h, Object *ref, char *starts, const char *when, const char *what) {
+   size_t off = (void*)ref - h->heap;
+   
+   if(ref != NULL && (off >= h->nextFree || off % GC_ALIGNMENT != 0 || 
+         !starts[off / GC_ALIGNMENT])) {
+      verifyFailed(when, "%s points to %p, heap offset %zd, not an object", 
+            what, (void*) ref, (ssize_t) off);
+   }
+}
+
+void verifyFailed(const char *when, const char *format, ...) {
+   va_list args;
+   
+   fprintf(stderr, "gc: heap corrupt %s: ", when);
+   va_start(args, format);
+   vfprintf(stderr, format, args);
+   va_end(args);
+   fprintf(stderr, "\n");
+   abort();
+}
+
+/* whatever wrote into free space did so through a stale pointer */
+void checkPoison(gc_heap_t *h, size_t start, size_t end, const char *when) {
+   unsigned char *b = h->heap;
+   size_t i;
+   
+   for(i = start; i < end; i++) {
+      if(b[i] != POISON) {
+         verifyFailed(when, "free byte at %zu overwritten", i);
+      }
+   }
+}
+
+/* poison what this collection freed: the holes and what lies between the
+ * new next_free and the old one */
+void poisonFree(gc_heap_t *h, size_t oldNextFree) {
+   int k;
+   
+   for(k = 0; k < h->freeHoles.num; k++) {
+      memset(h->heap + h->freeHoles.holes[k].start, POISON, 
+            h->freeHoles.holes[k].end - h->freeHoles.holes[k].start);
+   }
+   if(oldNextFree > h->nextFree) {
+      memset(h->heap + h->nextFree, POISON, oldNextFree - h->nextFree);
+   }
+}
+
+/* space handed out must still be poisoned; it is zeroed for its new object
+ * as never used space would be */
+void verifyFresh(gc_heap_t *h, void *p, size_t size) {
+   if(p != NULL) {
+      checkPoison(h, p - h->heap, p - h->heap + size, "allocating");
+      memset(p, 0, size);
+   }
+}
+#endif
@@ -2,29 +2,69 @@
  * Description:     Interface for gc.c
 */
 
+#include <stddef.h>
+#include <stdint.h>
+
 typedef unsigned char byte;
 
+/* every allocation is rounded up to a multiple of GC_ALIGNMENT bytes so the
+ * object that follows it starts on an aligned address; must be a power of 2 */
+#ifndef GC_ALIGNMENT
+#define GC_ALIGNMENT 8
+#endif
+#define GC_ALIGN(n) (((n) + GC_ALIGNMENT - 1) & ~((size_t) GC_ALIGNMENT - 1))
+
+/* Building with -DGC_COMPACT_HEADERS shrinks the object header to a 32-bit
+ * index into a class table, keeps mark bits in a side bitmap and computes
+ * forwarding addresses only while compacting. Managed pointer fields become
+ * 32-bit compressed references (8-byte granules from the heap start, plus one
+ * so 0 is NULL), so the heap is limited to 32 GB less a granule. Declare fields with GC_REF(type) and convert with
+ * gc_load()/gc_store() to write code that compiles under either layout.
+ */
+#ifdef GC_COMPACT_HEADERS
+#if GC_ALIGNMENT < 8
+#error "GC_COMPACT_HEADERS needs GC_ALIGNMENT of at least 8"
+#endif
+#define GC_HEADER           uint32_t class_id;
+#define GC_REF( type )      gc_ref
+#define GC_MAX_HEAP         (((size_t) 1 << 35) - 8)
+typedef uint32_t gc_ref;
+#else
+#define GC_HEADER           ClassDescriptor *class; byte marked; struct Object *forwarded;
+#define GC_REF( type )      type *
+#endif
+
 typedef struct ClassDescriptor {
     char *name;
-    int size;        /* size in bytes of struct */
+    size_t size;     /* size in bytes of struct */
     int num_fields;
     /* offset from ptr to object of only fields that are managed ptrs
         e.g., don't want to gc ptrs to functions, say */
     int *field_offsets;
+    int id;          /* index in the class table; assigned on first allocation */
 } ClassDescriptor;
 
 typedef struct Object {
+#ifdef GC_COMPACT_HEADERS
+	uint32_t class_id;
+#else
 	ClassDescriptor *class;
 	byte marked;
 	struct Object *forwarded; /* where we've moved this object */
+#endif
 } Object;
 
 typedef struct String /* extends Object */ {
+#ifdef GC_COMPACT_HEADERS
+	uint32_t class_id;
+	uint32_t length;
+#else
 	ClassDescriptor *class;
 	byte marked;
 	Object *forwarded;
 
-	int length;
+	size_t length;
+#endif
 	char str[];        
         /* the string starts at the end of fixed fields; this field
          * does not take any room in the structure; it's really just a
@@ -34,21 +74,147 @@ typedef struct String /* extends Object */ {
          */
 } String;
 
+/* A weak reference does not keep its referent alive; gc() clears it once
+ * nothing strong reaches the referent any more. */
+typedef struct WeakRef /* extends Object */ {
+	GC_HEADER
+	GC_REF(Object) referent;
+} WeakRef;
+
+/* Weak hash table of ephemerons: an entry keeps its value alive only as long
+ * as something outside the table keeps its key alive, and disappears with
+ * the key. Keys are compared by identity. */
+typedef struct gc_weak_table gc_weak_table;
+
 #define MAX_ROOTS 100
 
+/* order in which gc() lays out the objects that survive a collection */
+#define GC_ORDER_ADDRESS    0   /* slide down in place, keeping allocation order */
+#define GC_ORDER_DFS        1   /* depth first from the roots; parents next to children */
+#define GC_ORDER_BFS        2   /* breadth first from the roots; siblings together */
+
 extern ClassDescriptor String_class;
+extern ClassDescriptor WeakRef_class;
 extern Object **_roots[MAX_ROOTS];
 extern int _rp;
 
+/* running totals since gc_init() */
+typedef struct gc_stats {
+    long collections;
+    long compactions;       /* collections that moved objects rather than sweeping */
+    size_t bytes_copied;
+    double gc_seconds;      /* time spent collecting */
+    double longest_pause;   /* seconds */
+    double survival;        /* recent fraction of the used heap found live */
+    size_t heap_limit;      /* how full the heap may get before the next collection */
+} gc_stats;
+
+/* what gc_set_goal() sizes the heap for. Without a goal a collection runs
+ * only once the heap is full. */
+#define GC_GOAL_NONE        0
+#define GC_GOAL_THROUGHPUT  1   /* value: largest share of time spent collecting, e.g. 0.05 */
+#define GC_GOAL_PAUSE       2   /* value: longest pause in milliseconds */
+
+/* how gc_init_with() backs the heap; NUMA placement is best effort */
+#define GC_HEAP_THP         0x1 /* madvise transparent 2 MB huge pages */
+#define GC_HEAP_HUGETLB     0x2 /* explicit 2 MB huge pages, else GC_HEAP_THP */
+#define GC_HEAP_INTERLEAVE  0x4 /* interleave pages across all allowed NUMA nodes */
+#define GC_HEAP_LOCAL       0x8 /* prefer the NUMA node of the initializing thread */
+
+/* A heap and everything needed to collect it. Heaps are independent of each
+ * other, so each thread can own one and collect it without locking; the
+ * gc_heap_* functions take the heap to work on, and the gc_* functions without
+ * one work on a default heap. Objects must not point into another heap. */
+typedef struct gc_heap gc_heap_t;
+
+/* what gc_load_image() and gc_save_image() return */
+#define GC_IMAGE_OK         0
+#define GC_IMAGE_IO         -1  /* the file cannot be created, opened or written */
+#define GC_IMAGE_FORMAT     -2  /* not an image, damaged, or saved with another layout */
+#define GC_IMAGE_SPACE      -3  /* the heap is not empty or too small, or memory ran out */
+#define GC_IMAGE_ROOTS      -4  /* a different number of roots is registered */
+#define GC_IMAGE_CLASS      -5  /* a class the image uses is not given or has changed */
+#define GC_IMAGE_PINNED     -6  /* pinned objects leave holes an image cannot have */
+
 /* GC interface */
-extern void gc_init(int size);
+extern void gc_init(size_t size);
+extern void gc_init_with(size_t size, int flags);
 extern void gc();
 extern void gc_done();
 extern Object *gc_alloc(ClassDescriptor *class);
-extern String *gc_alloc_string(int size);
+extern String *gc_alloc_string(size_t size);
 extern char *gc_get_state();
 extern int gc_num_roots();
+extern size_t gc_used();
+extern void gc_set_compaction_order(int order);
+extern void gc_set_compaction_threshold(double fraction);
+extern void gc_get_stats(gc_stats *stats);
+extern void gc_set_goal(int goal, double value);
+extern WeakRef *gc_alloc_weak(Object *referent);
+extern Object *gc_weak_get(WeakRef *ref);
+extern gc_weak_table *gc_weak_table_new();
+extern void gc_weak_table_free(gc_weak_table *table);
+extern void gc_weak_table_put(gc_weak_table *table, Object *key, Object *value);
+extern Object *gc_weak_table_get(gc_weak_table *table, Object *key);
+extern int gc_weak_table_size(gc_weak_table *table);
+extern void gc_register_finalizer(Object *obj, void (*finalize)(Object *obj));
+extern void gc_run_finalizers();
+extern void gc_pin(Object *obj);
+extern void gc_unpin(Object *obj);
+extern int gc_save_image(const char *path);
+extern int gc_load_image(const char *path, ClassDescriptor **classes);
+
+extern gc_heap_t *gc_heap_init(size_t size, int flags);
+extern void gc_heap_collect(gc_heap_t *h);
+extern void gc_heap_done(gc_heap_t *h);
+extern Object *gc_heap_alloc(gc_heap_t *h, ClassDescriptor *class);
+extern String *gc_heap_alloc_string(gc_heap_t *h, size_t size);
+extern char *gc_heap_get_state(gc_heap_t *h);
+extern int gc_heap_num_roots(gc_heap_t *h);
+extern void gc_heap_push_root(gc_heap_t *h, Object **root);
+extern void gc_heap_pop_roots(gc_heap_t *h, int num);
+extern size_t gc_heap_used(gc_heap_t *h);
+extern void gc_heap_set_compaction_order(gc_heap_t *h, int order);
+extern void gc_heap_set_compaction_threshold(gc_heap_t *h, double fraction);
+extern void gc_heap_get_stats(gc_heap_t *h, gc_stats *stats);
+extern void gc_heap_set_goal(gc_heap_t *h, int goal, double value);
+extern WeakRef *gc_heap_alloc_weak(gc_heap_t *h, Object *referent);
+extern Object *gc_heap_weak_get(gc_heap_t *h, WeakRef *ref);
+extern gc_weak_table *gc_heap_weak_table_new(gc_heap_t *h);
+extern void gc_heap_register_finalizer(gc_heap_t *h, Object *obj, void (*finalize)(Object *obj));
+extern void gc_heap_run_finalizers(gc_heap_t *h);
+extern void gc_heap_pin(gc_heap_t *h, Object *obj);
+extern void gc_heap_unpin(gc_heap_t *h, Object *obj);
+extern int gc_heap_save_image(gc_heap_t *h, const char *path);
+extern int gc_heap_load_image(gc_heap_t *h, const char *path, ClassDescriptor **classes);
+
+#ifdef GC_COMPACT_HEADERS
+extern void *heap;
+static inline void *gc_load(gc_ref r) {
+    return r == 0 ? NULL : (byte *) heap + (((size_t) r - 1) << 3);
+}
+static inline gc_ref gc_store(void *p) {
+    return p == NULL ? 0 : (gc_ref) ((((byte *) p - (byte *) heap) >> 3) + 1);
+}
+/* references are relative to the heap they live in; a gc_heap_t starts
+ * with the address of its heap */
+static inline void *gc_heap_load(gc_heap_t *h, gc_ref r) {
+    return r == 0 ? NULL : *(byte **) h + (((size_t) r - 1) << 3);
+}
+static inline gc_ref gc_heap_store(gc_heap_t *h, void *p) {
+    return p == NULL ? 0 : (gc_ref) ((((byte *) p - *(byte **) h) >> 3) + 1);
+}
+#else
+#define gc_load( r )        (r)
+#define gc_store( p )       (p)
+#define gc_heap_load( h, r )    (r)
+#define gc_heap_store( h, p )   (p)
+#endif
 
 #define gc_save_rp          int __rp = _rp;
 #define gc_add_root( p )    _roots[_rp++] = (Object **)(&(p));
-#define gc_restore_roots    _rp = __rp;
\ No newline at end of file
+#define gc_restore_roots    _rp = __rp;
+
+#define gc_heap_save_rp( h )        int __rp = gc_heap_num_roots(h);
+#define gc_heap_add_root( h, p )    gc_heap_push_root(h, (Object **)(&(p)));
+#define gc_heap_restore_roots( h )  gc_heap_pop_roots(h, __rp);
\ No newline at end of file
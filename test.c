@@ -1,7 +1,7 @@
 /* Author:          Terence Parr 
  * Description:     An example of how to use the garbage collector (gc.c). Also tests the
                     functionality. A successful run will have no output.
- * Compile:         gcc -g -Wall -o gc gc.c test.c
+ * Compile:         gcc -g -Wall -o gc gc.c test.c -lpthread
  * Usage:           ./gc
  */
 
@@ -10,7 +10,13 @@
 #include <stddef.h>
 #include <string.h>
 #include <math.h>
+#include <unistd.h>
+#include <fcntl.h>
 #include "gc.h"
+#ifdef GC_VERIFY
+#include <signal.h>
+#include <sys/wait.h>
+#endif
 
 #define ASSERT(EXPECTED, RESULT)\
   if(EXPECTED != RESULT) { printf("\n%-30s failure on line %d; expecting %d found %d\n", \
@@ -19,15 +25,36 @@
   if(strcmp(EXPECTED,RESULT)!=0) { printf("\n%-30s failure on line %d; expecting:\n%s\nfound:\n%s\n", \
         __func__, __LINE__, EXPECTED, RESULT); }
 
+/* the expected heap states are worked out for the default GC_ALIGNMENT of 8;
+ * built with another, the tests still run but leave the states unchecked */
+#if GC_ALIGNMENT == 8
+#define STATE_ASSERT(EXPECTED, FOUND) STR_ASSERT(EXPECTED, FOUND)
+#else
+#define STATE_ASSERT(EXPECTED, FOUND) (void) (EXPECTED)
+#endif
+
+void check_state(char *expected) {
+    char *found = gc_get_state();
+    STATE_ASSERT(expected, found);
+    free(found);
+}
+
+
+/* the expected state of the heap differs between the object layouts only in
+ * the sizes and offsets of the objects */
+#ifdef GC_COMPACT_HEADERS
+#define LAYOUT(FULL, COMPACT)   COMPACT
+#else
+#define LAYOUT(FULL, COMPACT)   FULL
+#endif
+
 typedef struct User /* extends Object */ {
-    ClassDescriptor *class;
-    byte marked;
-    Object *forwarded; // where we've moved this object
+    GC_HEADER
 
     int userid;
     int parking_sport;
     float salary;
-    String *name;
+    GC_REF(String) name;
 } User;
 
 ClassDescriptor User_class = {
@@ -38,13 +65,11 @@ ClassDescriptor User_class = {
 };
 
 typedef struct Employee /* extends Object */ {
-    ClassDescriptor *class;
-    byte marked;
-    Object *forwarded; // where we've moved this object
-    
+    GC_HEADER
+
     int ID;
-    String *name;
-    struct Employee *mgr;
+    GC_REF(String) name;
+    GC_REF(struct Employee) mgr;
 } Employee;
 
 ClassDescriptor Employee_class = {
@@ -57,10 +82,10 @@ ClassDescriptor Employee_class = {
     }
 };
 
-void check_state(char *expected) {
-    char *found = gc_get_state();
-    STR_ASSERT(expected, found);
-    free(found);
+void test_header_sizes() {
+    ASSERT(LAYOUT(24, 4), (int) sizeof(Object));
+    ASSERT(LAYOUT(32, 8), (int) sizeof(String));
+    ASSERT(LAYOUT(48, 16), (int) sizeof(Employee));
 }
 
 void test_alloc_str_gc_compact_does_nothing() {
@@ -74,24 +99,30 @@ void test_alloc_str_gc_compact_does_nothing() {
     strcpy(a->str, "hi mom");
 
     {
-        char *expected =
-                "next_free=43\n"
+        char *expected = LAYOUT(
+                "next_free=48\n"
                 "objects:\n"
-                "  0000:String[32+11]=\"hi mom\"\n";
+                "  0000:String[32+11]=\"hi mom\"\n",
+                "next_free=24\n"
+                "objects:\n"
+                "  0000:String[8+11]=\"hi mom\"\n");
         char *found = gc_get_state();
-        STR_ASSERT(expected, found);
+        STATE_ASSERT(expected, found);
         free(found);
     }
 
     gc();
 
     {
-        char *expected =
-                "next_free=43\n"
+        char *expected = LAYOUT(
+                "next_free=48\n"
+                "objects:\n"
+                "  0000:String[32+11]=\"hi mom\"\n",
+                "next_free=24\n"
                 "objects:\n"
-                "  0000:String[32+11]=\"hi mom\"\n";
+                "  0000:String[8+11]=\"hi mom\"\n");
         char *found = gc_get_state();
-        STR_ASSERT(expected, found);
+        STATE_ASSERT(expected, found);
         free(found);
     }
 
@@ -110,12 +141,15 @@ void test_alloc_str_set_null_gc() {
     strcpy(a->str, "hi mom");
 
     {
-        char *expected =
-                "next_free=43\n"
+        char *expected = LAYOUT(
+                "next_free=48\n"
                 "objects:\n"
-                "  0000:String[32+11]=\"hi mom\"\n";
+                "  0000:String[32+11]=\"hi mom\"\n",
+                "next_free=24\n"
+                "objects:\n"
+                "  0000:String[8+11]=\"hi mom\"\n");
         char *found = gc_get_state();
-        STR_ASSERT(expected, found);
+        STATE_ASSERT(expected, found);
         free(found);
     }
 
@@ -128,7 +162,7 @@ void test_alloc_str_set_null_gc() {
                 "next_free=0\n"
                 "objects:\n";
         char *found = gc_get_state();
-        STR_ASSERT(expected, found);
+        STATE_ASSERT(expected, found);
         free(found);
     }
 
@@ -147,12 +181,15 @@ void test_alloc_2_str_overwrite_first_one_gc() {
     strcpy(a->str, "hi mom");
 
     {
-        char *expected =
-                "next_free=43\n"
+        char *expected = LAYOUT(
+                "next_free=48\n"
+                "objects:\n"
+                "  0000:String[32+11]=\"hi mom\"\n",
+                "next_free=24\n"
                 "objects:\n"
-                "  0000:String[32+11]=\"hi mom\"\n";
+                "  0000:String[8+11]=\"hi mom\"\n");
         char *found = gc_get_state();
-        STR_ASSERT(expected, found);
+        STATE_ASSERT(expected, found);
         free(found);
     }
 
@@ -162,12 +199,15 @@ void test_alloc_2_str_overwrite_first_one_gc() {
     gc();
 
     {
-        char *expected = // compacts out dead stuff
-                "next_free=43\n"
+        char *expected = LAYOUT( // compacts out dead stuff
+                "next_free=48\n"
+                "objects:\n"
+                "  0000:String[32+11]=\"hi dad\"\n",
+                "next_free=24\n"
                 "objects:\n"
-                "  0000:String[32+11]=\"hi dad\"\n";
+                "  0000:String[8+11]=\"hi dad\"\n");
         char *found = gc_get_state();
-        STR_ASSERT(expected, found);
+        STATE_ASSERT(expected, found);
         free(found);
     }
 
@@ -183,17 +223,22 @@ void test_alloc_user() {
     User *u = (User *) gc_alloc(&User_class);
     gc_add_root(u);
 
-    u->name = gc_alloc_string(20);
-    strcpy(u->name->str, "parrt");
+    String *s = gc_alloc_string(20);
+    strcpy(s->str, "parrt");
+    u->name = gc_store(s);
 
     {
-        char *expected = // compacts out dead stuff
-                "next_free=101\n"
+        char *expected = LAYOUT( // compacts out dead stuff
+                "next_free=104\n"
                 "objects:\n"
                 "  0000:User[48]->[48]\n"
-                "  0048:String[32+21]=\"parrt\"\n";
+                "  0048:String[32+21]=\"parrt\"\n",
+                "next_free=56\n"
+                "objects:\n"
+                "  0000:User[20]->[24]\n"
+                "  0024:String[8+21]=\"parrt\"\n");
         char *found = gc_get_state();
-        STR_ASSERT(expected, found);
+        STATE_ASSERT(expected, found);
         free(found);
     }
 
@@ -206,7 +251,7 @@ void test_alloc_user() {
                 "next_free=0\n"
                 "objects:\n";
         char *found = gc_get_state();
-        STR_ASSERT(expected, found);
+        STATE_ASSERT(expected, found);
         free(found);
     }
 
@@ -224,16 +269,20 @@ void test_alloc_user_after_string() {
 
     User *u = (User *) gc_alloc(&User_class);
     gc_add_root(u);
-    u->name = s;
+    u->name = gc_store(s);
 
     {
-        char *expected = // compacts out dead stuff
-                "next_free=101\n"
+        char *expected = LAYOUT( // compacts out dead stuff
+                "next_free=104\n"
                 "objects:\n"
                 "  0000:String[32+21]=\"parrt\"\n"
-                "  0053:User[48]->[0]\n";
+                "  0056:User[48]->[0]\n",
+                "next_free=56\n"
+                "objects:\n"
+                "  0000:String[8+21]=\"parrt\"\n"
+                "  0032:User[20]->[0]\n");
         char *found = gc_get_state();
-        STR_ASSERT(expected, found);
+        STATE_ASSERT(expected, found);
         free(found);
     }
 
@@ -242,12 +291,15 @@ void test_alloc_user_after_string() {
     gc();
 
     {
-        char *expected = // compacts out dead stuff
-                "next_free=53\n"
+        char *expected = LAYOUT( // compacts out dead stuff
+                "next_free=56\n"
                 "objects:\n"
-                "  0000:String[32+21]=\"parrt\"\n";
+                "  0000:String[32+21]=\"parrt\"\n",
+                "next_free=32\n"
+                "objects:\n"
+                "  0000:String[8+21]=\"parrt\"\n");
         char *found = gc_get_state();
-        STR_ASSERT(expected, found);
+        STATE_ASSERT(expected, found);
         free(found);
     }
 
@@ -262,27 +314,34 @@ void test_alloc_obj_with_two_ptr_fields() {
     Employee *tombu = (Employee *) gc_alloc(&Employee_class);
     String *s = gc_alloc_string(3);
     strcpy(s->str, "Tom");
-    tombu->name = s;
+    tombu->name = gc_store(s);
 
     Employee *parrt = (Employee *) gc_alloc(&Employee_class);
-    parrt->name = gc_alloc_string(10);
-    strcpy(parrt->name->str, "Terence");
-    parrt->mgr = tombu;
+    s = gc_alloc_string(10);
+    strcpy(s->str, "Terence");
+    parrt->name = gc_store(s);
+    parrt->mgr = gc_store(tombu);
 
     gc_add_root(parrt); // just one root
-    
+
     gc();
 
     {
-        char *expected = // compacts out dead stuff
-            "next_free=175\n"
+        char *expected = LAYOUT( // compacts out dead stuff
+            "next_free=184\n"
             "objects:\n"
             "  0000:Employee[48]->[48,NULL]\n"
             "  0048:String[32+4]=\"Tom\"\n"
-            "  0084:Employee[48]->[132,0]\n"
-            "  0132:String[32+11]=\"Terence\"\n";
+            "  0088:Employee[48]->[136,0]\n"
+            "  0136:String[32+11]=\"Terence\"\n",
+            "next_free=72\n"
+            "objects:\n"
+            "  0000:Employee[16]->[16,NULL]\n"
+            "  0016:String[8+4]=\"Tom\"\n"
+            "  0032:Employee[16]->[48,0]\n"
+            "  0048:String[8+11]=\"Terence\"\n");
         char *found = gc_get_state();
-        STR_ASSERT(expected, found);
+        STATE_ASSERT(expected, found);
         free(found);
     }
 
@@ -297,27 +356,32 @@ void test_alloc_obj_kill_mgr_ptr() {
     Employee *tombu = (Employee *) gc_alloc(&Employee_class);
     String *s = gc_alloc_string(3);
     strcpy(s->str, "Tom");
-    tombu->name = s;
+    tombu->name = gc_store(s);
 
     Employee *parrt = (Employee *) gc_alloc(&Employee_class);
-    parrt->name = gc_alloc_string(10);
-    strcpy(parrt->name->str, "Terence");
-    parrt->mgr = tombu;
+    s = gc_alloc_string(10);
+    strcpy(s->str, "Terence");
+    parrt->name = gc_store(s);
+    parrt->mgr = gc_store(tombu);
 
     gc_add_root(parrt); // just one root
-    
-    parrt->mgr = NULL; // 2 objects live
-    
+
+    parrt->mgr = gc_store(NULL); // 2 objects live
+
     gc();
 
     {
-        char *expected = // compacts out dead stuff
-            "next_free=91\n"
+        char *expected = LAYOUT( // compacts out dead stuff
+            "next_free=96\n"
             "objects:\n"
             "  0000:Employee[48]->[48,NULL]\n"
-            "  0048:String[32+11]=\"Terence\"\n";
+            "  0048:String[32+11]=\"Terence\"\n",
+            "next_free=40\n"
+            "objects:\n"
+            "  0000:Employee[16]->[16,NULL]\n"
+            "  0016:String[8+11]=\"Terence\"\n");
         char *found = gc_get_state();
-        STR_ASSERT(expected, found);
+        STATE_ASSERT(expected, found);
         free(found);
     }
 
@@ -332,30 +396,37 @@ void test_mgr_cycle() {
     Employee *tombu = (Employee *) gc_alloc(&Employee_class);
     String *s = gc_alloc_string(3);
     strcpy(s->str, "Tom");
-    tombu->name = s;
+    tombu->name = gc_store(s);
 
     Employee *parrt = (Employee *) gc_alloc(&Employee_class);
-    parrt->name = gc_alloc_string(10);
-    strcpy(parrt->name->str, "Terence");
+    s = gc_alloc_string(10);
+    strcpy(s->str, "Terence");
+    parrt->name = gc_store(s);
 
     // CYCLE
-    parrt->mgr = tombu;
-    tombu->mgr = parrt;
+    parrt->mgr = gc_store(tombu);
+    tombu->mgr = gc_store(parrt);
 
     gc_add_root(parrt); // just one root; can it find everyone and not freak out?
-    
+
     gc();
 
     {
-        char *expected = // compacts out dead stuff
-            "next_free=175\n"
+        char *expected = LAYOUT( // compacts out dead stuff
+            "next_free=184\n"
             "objects:\n"
-            "  0000:Employee[48]->[48,84]\n"
+            "  0000:Employee[48]->[48,88]\n"
             "  0048:String[32+4]=\"Tom\"\n"
-            "  0084:Employee[48]->[132,0]\n"
-            "  0132:String[32+11]=\"Terence\"\n";
+            "  0088:Employee[48]->[136,0]\n"
+            "  0136:String[32+11]=\"Terence\"\n",
+            "next_free=72\n"
+            "objects:\n"
+            "  0000:Employee[16]->[16,32]\n"
+            "  0016:String[8+4]=\"Tom\"\n"
+            "  0032:Employee[16]->[48,0]\n"
+            "  0048:String[8+11]=\"Terence\"\n");
         char *found = gc_get_state();
-        STR_ASSERT(expected, found);
+        STATE_ASSERT(expected, found);
         free(found);
     }
 
@@ -370,129 +441,1438 @@ void test_mgr_cycle_kill_one_link() {
     Employee *tombu = (Employee *) gc_alloc(&Employee_class);
     String *s = gc_alloc_string(3);
     strcpy(s->str, "Tom");
-    tombu->name = s;
+    tombu->name = gc_store(s);
 
     Employee *parrt = (Employee *) gc_alloc(&Employee_class);
-    parrt->name = gc_alloc_string(10);
-    strcpy(parrt->name->str, "Terence");
+    s = gc_alloc_string(10);
+    strcpy(s->str, "Terence");
+    parrt->name = gc_store(s);
 
     // CYCLE
-    parrt->mgr = tombu;
-    tombu->mgr = parrt;
+    parrt->mgr = gc_store(tombu);
+    tombu->mgr = gc_store(parrt);
 
     gc_add_root(parrt); // just one root; can it find everyone and not freak out?
-    
-    parrt->mgr = NULL;  // can't see tombu from anywhere
-    
+
+    parrt->mgr = gc_store(NULL);  // can't see tombu from anywhere
+
     gc();
 
     {
-        char *expected = // compacts out dead stuff
-            "next_free=91\n"
+        char *expected = LAYOUT( // compacts out dead stuff
+            "next_free=96\n"
             "objects:\n"
             "  0000:Employee[48]->[48,NULL]\n"
-            "  0048:String[32+11]=\"Terence\"\n";
+            "  0048:String[32+11]=\"Terence\"\n",
+            "next_free=40\n"
+            "objects:\n"
+            "  0000:Employee[16]->[16,NULL]\n"
+            "  0016:String[8+11]=\"Terence\"\n");
         char *found = gc_get_state();
-        STR_ASSERT(expected, found);
+        STATE_ASSERT(expected, found);
         free(found);
     }
+    STR_ASSERT("Terence", ((String *) gc_load(parrt->name))->str);
 
     gc_restore_roots;
     gc_done();
 }
 
-void test_template() {
+void test_slide_over_own_header() {
     gc_init(1000);
     gc_save_rp;
 
-    // gc_add_root(s);
+    gc_alloc_string(1); // garbage, shorter than the header of what follows
+    String *a = gc_alloc_string(40);
+    gc_add_root(a);
+    strcpy(a->str, "0123456789abcdef0123456789abcdef01234567");
+
+    gc();
+
+    check_state(LAYOUT(
+            "next_free=80\n"
+            "objects:\n"
+            "  0000:String[32+41]=\"0123456789abcdef0123456789abcdef01234567\"\n",
+            "next_free=56\n"
+            "objects:\n"
+            "  0000:String[8+41]=\"0123456789abcdef0123456789abcdef01234567\"\n"));
 
     gc_restore_roots;
     gc_done();
 }
 
-void test_automatic_gc() {
-    gc_init(90);
+void test_alloc_is_aligned() {
+    gc_init(1000);
     gc_save_rp;
 
-    User *u = (User *) gc_alloc(&User_class);
-    gc_add_root(u);
+    String *s = gc_alloc_string(4);
+    gc_add_root(s);
+    Employee *e = (Employee *) gc_alloc(&Employee_class);
+    gc_add_root(e);
+    e->name = gc_store(gc_alloc_string(1));
+    String *t = gc_alloc_string(7);
+    gc_add_root(t);
+    strcpy(s->str, "abcd");
+    strcpy(t->str, "defghij");
 
-    u->name = gc_alloc_string(5);
-    strcpy(u->name->str, "parrt");
+    ASSERT(0, (int) ((size_t) s % GC_ALIGNMENT));
+    ASSERT(0, (int) ((size_t) e % GC_ALIGNMENT));
+    ASSERT(0, (int) ((size_t) gc_load(e->name) % GC_ALIGNMENT));
+    ASSERT(0, (int) ((size_t) t % GC_ALIGNMENT));
 
-    {
-        char *expected = // compacts out dead stuff
-                "next_free=86\n"
-                "objects:\n"
-                "  0000:User[48]->[48]\n"
-                "  0048:String[32+6]=\"parrt\"\n";
-        char *found = gc_get_state();
-        STR_ASSERT(expected, found);
-        free(found);
+    e = NULL; // slide t down over the dead employee and its name
+
+    gc();
+
+    ASSERT(0, (int) ((size_t) t % GC_ALIGNMENT));
+    check_state(LAYOUT(
+            "next_free=80\n"
+            "objects:\n"
+            "  0000:String[32+5]=\"abcd\"\n"
+            "  0040:String[32+8]=\"defghij\"\n",
+            "next_free=32\n"
+            "objects:\n"
+            "  0000:String[8+5]=\"abcd\"\n"
+            "  0016:String[8+8]=\"defghij\"\n"));
+
+    gc_restore_roots;
+    gc_done();
+}
+
+// live objects spread over many mark words must all land at the right place
+
+void test_slide_across_mark_words() {
+    gc_init(100000);
+    gc_save_rp;
+
+    Employee *head = NULL;
+    Employee *e;
+    String *s;
+    int i;
+    gc_add_root(head);
+
+    for (i = 0; i < 200; i++) {
+        gc_alloc_string(i % 13); // garbage
+        e = (Employee *) gc_alloc(&Employee_class);
+        e->ID = i;
+        s = gc_alloc_string(7);
+        sprintf(s->str, "emp%d", i);
+        e->name = gc_store(s);
+        e->mgr = gc_store(head);
+        head = e;
     }
 
-    u = NULL; // should free user and string
-    
-    User *q = (User *) gc_alloc(&User_class);
-    gc_add_root(q);
-    
-    q->name = gc_alloc_string(6);
-    strcpy(q->name->str, "steely");
-    
-    {
-        char *expected = // compacts out dead stuff
-                "next_free=87\n"
-                "objects:\n"
-                "  0000:User[48]->[48]\n"
-                "  0048:String[32+7]=\"steely\"\n";;
-                
-        char *found = gc_get_state();
-        STR_ASSERT(expected, found);
-        free(found);
+    gc();
+
+    ASSERT(200 * (int) (GC_ALIGN(sizeof(Employee)) + GC_ALIGN(sizeof(String) + 8)), (int) gc_used());
+    for (i = 199, e = head; e != NULL; i--, e = gc_load(e->mgr)) {
+        char expected[16];
+        sprintf(expected, "emp%d", i);
+        ASSERT(i, e->ID);
+        STR_ASSERT(expected, ((String *) gc_load(e->name))->str);
     }
+    ASSERT(-1, i);
 
     gc_restore_roots;
     gc_done();
 }
 
-void test_loop() {
-    gc_init(500);
+// survivors laid out in traversal order rather than allocation order
+
+void test_dfs_order() {
+    gc_init(1000);
+    gc_set_compaction_order(GC_ORDER_DFS);
     gc_save_rp;
-   
-	Employee *parrt;
-   	gc_add_root(parrt);
 
-	int i;
-	parrt = (Employee *) gc_alloc(&Employee_class);
-	
-	for (i=0;i<1000;i++){
-      printf("\n*****************iteration %d*****************\n\n", i);
-      // parrt = NULL; 
-		parrt = (Employee *) gc_alloc(&Employee_class);
-		parrt->name = gc_alloc_string(10);
-      printf("parrt->name: %s\n", parrt->class->name);	    
-	}
-    strcpy(parrt->name->str, "Terence");
-       
+    Employee *tombu = (Employee *) gc_alloc(&Employee_class);
+    String *s = gc_alloc_string(3);
+    strcpy(s->str, "Tom");
+    tombu->name = gc_store(s);
+
+    Employee *parrt = (Employee *) gc_alloc(&Employee_class);
+    s = gc_alloc_string(10);
+    strcpy(s->str, "Terence");
+    parrt->name = gc_store(s);
+
+    gc_add_root(parrt);
+    gc_add_root(tombu);
+
     gc();
-   
-    {
-        char *expected = // compacts out dead stuff
-            "next_free=91\n"
+
+    check_state(LAYOUT(
+            "next_free=184\n"
             "objects:\n"
             "  0000:Employee[48]->[48,NULL]\n"
-            "  0048:String[32+11]=\"Terence\"\n";
-        char *found = gc_get_state();
-        STR_ASSERT(expected, found);
-        free(found);
-    }
-   
+            "  0048:String[32+11]=\"Terence\"\n"
+            "  0096:Employee[48]->[144,NULL]\n"
+            "  0144:String[32+4]=\"Tom\"\n",
+            "next_free=72\n"
+            "objects:\n"
+            "  0000:Employee[16]->[16,NULL]\n"
+            "  0016:String[8+11]=\"Terence\"\n"
+            "  0040:Employee[16]->[56,NULL]\n"
+            "  0056:String[8+4]=\"Tom\"\n"));
+    STR_ASSERT("Tom", ((String *) gc_load(tombu->name))->str);
+
+    gc_restore_roots;
+    gc_done();
+}
+
+void test_bfs_order() {
+    gc_init(1000);
+    gc_set_compaction_order(GC_ORDER_BFS);
+    gc_save_rp;
+
+    Employee *tombu = (Employee *) gc_alloc(&Employee_class);
+    String *s = gc_alloc_string(3);
+    strcpy(s->str, "Tom");
+    tombu->name = gc_store(s);
+
+    Employee *parrt = (Employee *) gc_alloc(&Employee_class);
+    s = gc_alloc_string(10);
+    strcpy(s->str, "Terence");
+    parrt->name = gc_store(s);
+
+    gc_add_root(parrt);
+    gc_add_root(tombu);
+
+    gc();
+
+    check_state(LAYOUT(
+            "next_free=184\n"
+            "objects:\n"
+            "  0000:Employee[48]->[96,NULL]\n"
+            "  0048:Employee[48]->[144,NULL]\n"
+            "  0096:String[32+11]=\"Terence\"\n"
+            "  0144:String[32+4]=\"Tom\"\n",
+            "next_free=72\n"
+            "objects:\n"
+            "  0000:Employee[16]->[32,NULL]\n"
+            "  0016:Employee[16]->[56,NULL]\n"
+            "  0032:String[8+11]=\"Terence\"\n"
+            "  0056:String[8+4]=\"Tom\"\n"));
+
+    gc_restore_roots;
+    gc_done();
+}
+
+void test_dfs_order_cycle_drops_garbage() {
+    gc_init(1000);
+    gc_set_compaction_order(GC_ORDER_DFS);
+    gc_save_rp;
+
+    Employee *tombu = (Employee *) gc_alloc(&Employee_class);
+    String *s = gc_alloc_string(3);
+    strcpy(s->str, "Tom");
+    tombu->name = gc_store(s);
+    gc_alloc_string(20); // garbage
+
+    Employee *parrt = (Employee *) gc_alloc(&Employee_class);
+    s = gc_alloc_string(10);
+    strcpy(s->str, "Terence");
+    parrt->name = gc_store(s);
+    parrt->mgr = gc_store(tombu);
+    tombu->mgr = gc_store(parrt);
+
+    gc_add_root(tombu);
+
+    gc();
+
+    check_state(LAYOUT(
+            "next_free=184\n"
+            "objects:\n"
+            "  0000:Employee[48]->[48,88]\n"
+            "  0048:String[32+4]=\"Tom\"\n"
+            "  0088:Employee[48]->[136,0]\n"
+            "  0136:String[32+11]=\"Terence\"\n",
+            "next_free=72\n"
+            "objects:\n"
+            "  0000:Employee[16]->[16,32]\n"
+            "  0016:String[8+4]=\"Tom\"\n"
+            "  0032:Employee[16]->[48,0]\n"
+            "  0048:String[8+11]=\"Terence\"\n"));
+
+    gc_restore_roots;
+    gc_done();
+}
+
+// placement flags only change how the heap is backed, never its contents
+
+void test_huge_page_numa_heap() {
+    gc_init_with(3 << 20, GC_HEAP_HUGETLB | GC_HEAP_INTERLEAVE);
+    gc_save_rp;
+
+    User *u = (User *) gc_alloc(&User_class);
+    gc_add_root(u);
+    gc_alloc_string(100); // garbage
+    String *s = gc_alloc_string(5);
+    strcpy(s->str, "parrt");
+    u->name = gc_store(s);
+
+    gc();
+
+    check_state(LAYOUT(
+            "next_free=88\n"
+            "objects:\n"
+            "  0000:User[48]->[48]\n"
+            "  0048:String[32+6]=\"parrt\"\n",
+            "next_free=40\n"
+            "objects:\n"
+            "  0000:User[20]->[24]\n"
+            "  0024:String[8+6]=\"parrt\"\n"));
+
+    gc_restore_roots;
+    gc_done();
+}
+
+void test_weak_ref_cleared() {
+    gc_init(1000);
+    gc_save_rp;
+
+    String *s = gc_alloc_string(5);
+    strcpy(s->str, "cache");
+    WeakRef *w = gc_alloc_weak((Object *) s);
+    gc_add_root(w);
+
+    check_state(LAYOUT(
+            "next_free=72\n"
+            "objects:\n"
+            "  0000:String[32+6]=\"cache\"\n"
+            "  0040:WeakRef[32]->[0]\n",
+            "next_free=24\n"
+            "objects:\n"
+            "  0000:String[8+6]=\"cache\"\n"
+            "  0016:WeakRef[8]->[0]\n"));
+
+    gc(); // nothing strong reaches the string
+
+    check_state(LAYOUT(
+            "next_free=32\n"
+            "objects:\n"
+            "  0000:WeakRef[32]->[NULL]\n",
+            "next_free=8\n"
+            "objects:\n"
+            "  0000:WeakRef[8]->[NULL]\n"));
+    ASSERT(1, (gc_weak_get(w) == NULL));
+
+    gc_restore_roots;
+    gc_done();
+}
+
+void test_weak_ref_follows_moved_referent() {
+    gc_init(1000);
+    gc_save_rp;
+
+    gc_alloc_string(20); // garbage
+    String *s = gc_alloc_string(5);
+    strcpy(s->str, "cache");
+    gc_add_root(s);
+    WeakRef *w = gc_alloc_weak((Object *) s);
+    gc_add_root(w);
+
+    gc();
+
+    check_state(LAYOUT(
+            "next_free=72\n"
+            "objects:\n"
+            "  0000:String[32+6]=\"cache\"\n"
+            "  0040:WeakRef[32]->[0]\n",
+            "next_free=24\n"
+            "objects:\n"
+            "  0000:String[8+6]=\"cache\"\n"
+            "  0016:WeakRef[8]->[0]\n"));
+    ASSERT(1, (gc_weak_get(w) == (Object *) s));
+
+    gc_restore_roots;
+    gc_done();
+}
+
+// an entry keeps its value only while the key is alive elsewhere
+
+void test_weak_table_entry_dies_with_key() {
+    gc_init(1000);
+    gc_save_rp;
+    gc_weak_table *t = gc_weak_table_new();
+
+    gc_alloc_string(20); // garbage
+    Employee *parrt = (Employee *) gc_alloc(&Employee_class);
+    gc_add_root(parrt);
+    String *v = gc_alloc_string(6);
+    strcpy(v->str, "cached");
+    gc_weak_table_put(t, (Object *) parrt, (Object *) v);
+    WeakRef *w = gc_alloc_weak((Object *) v);
+    gc_add_root(w);
+    v = NULL;
+
+    gc();
+
+    check_state(LAYOUT(
+            "next_free=120\n"
+            "objects:\n"
+            "  0000:Employee[48]->[NULL,NULL]\n"
+            "  0048:String[32+7]=\"cached\"\n"
+            "  0088:WeakRef[32]->[48]\n",
+            "next_free=40\n"
+            "objects:\n"
+            "  0000:Employee[16]->[NULL,NULL]\n"
+            "  0016:String[8+7]=\"cached\"\n"
+            "  0032:WeakRef[8]->[16]\n"));
+    ASSERT(1, gc_weak_table_size(t));
+    STR_ASSERT("cached", ((String *) gc_weak_table_get(t, (Object *) parrt))->str);
+    ASSERT(1, (gc_weak_get(w) == gc_weak_table_get(t, (Object *) parrt)));
+
+    parrt = NULL;
+
+    gc();
+
+    check_state(LAYOUT(
+            "next_free=32\n"
+            "objects:\n"
+            "  0000:WeakRef[32]->[NULL]\n",
+            "next_free=8\n"
+            "objects:\n"
+            "  0000:WeakRef[8]->[NULL]\n"));
+    ASSERT(0, gc_weak_table_size(t));
+
+    gc_weak_table_free(t);
+    gc_restore_roots;
+    gc_done();
+}
+
+void test_weak_table_ignores_null_key() {
+    gc_init(1000);
+    gc_save_rp;
+    gc_weak_table *t = gc_weak_table_new();
+    gc_set_compaction_order(GC_ORDER_DFS);
+
+    gc_weak_table_put(t, NULL, (Object *) gc_alloc_string(6));
+    ASSERT(0, gc_weak_table_size(t));
+    STR_ASSERT("NULL", gc_weak_table_get(t, NULL) == NULL ? "NULL" : "a value");
+
+    gc(); // nothing holds the value
+
+    check_state(
+            "next_free=0\n"
+            "objects:\n");
+
+    gc_weak_table_free(t);
+    gc_restore_roots;
+    gc_done();
+}
+
+void test_weak_table_value_pointing_at_key_dies() {
+    gc_init(1000);
+    gc_save_rp;
+    gc_weak_table *t = gc_weak_table_new();
+
+    Employee *tombu = (Employee *) gc_alloc(&Employee_class);
+    Employee *parrt = (Employee *) gc_alloc(&Employee_class);
+    parrt->mgr = gc_store(tombu); // value reaches the key; must not keep it alive
+    gc_weak_table_put(t, (Object *) tombu, (Object *) parrt);
+
+    gc();
+
+    check_state(
+            "next_free=0\n"
+            "objects:\n");
+    ASSERT(0, gc_weak_table_size(t));
+
+    gc_weak_table_free(t);
+    gc_restore_roots;
+    gc_done();
+}
+
+int finalized;
+char finalized_name[16];
+
+void finalize_string(Object *obj) {
+    finalized++;
+    strcpy(finalized_name, ((String *) obj)->str);
+}
+
+void test_finalizer_runs_outside_gc() {
+    gc_init(1000);
+    gc_save_rp;
+    finalized = 0;
+
+    gc_alloc_string(20); // garbage
+    String *s = gc_alloc_string(3);
+    strcpy(s->str, "fd7");
+    gc_add_root(s);
+    gc_register_finalizer((Object *) s, finalize_string);
+    WeakRef *w = gc_alloc_weak((Object *) s);
+    gc_add_root(w);
+
+    gc();
+    ASSERT(0, finalized);
+
+    s = NULL;
+
+    gc(); // kept until its finalizer runs, but weak refs are cleared
+
+    ASSERT(0, finalized);
+    ASSERT(1, (gc_weak_get(w) == NULL));
+    check_state(LAYOUT(
+            "next_free=72\n"
+            "objects:\n"
+            "  0000:String[32+4]=\"fd7\"\n"
+            "  0040:WeakRef[32]->[NULL]\n",
+            "next_free=24\n"
+            "objects:\n"
+            "  0000:String[8+4]=\"fd7\"\n"
+            "  0016:WeakRef[8]->[NULL]\n"));
+
+    gc_run_finalizers();
+    ASSERT(1, finalized);
+    STR_ASSERT("fd7", finalized_name);
+
+    gc();
+
+    check_state(LAYOUT(
+            "next_free=32\n"
+            "objects:\n"
+            "  0000:WeakRef[32]->[NULL]\n",
+            "next_free=8\n"
+            "objects:\n"
+            "  0000:WeakRef[8]->[NULL]\n"));
+    gc_run_finalizers();
+    ASSERT(1, finalized);
+
+    gc_restore_roots;
+    gc_done();
+}
+
+void test_weak_table_with_dfs_order() {
+    gc_init(1000);
+    gc_set_compaction_order(GC_ORDER_DFS);
+    gc_save_rp;
+    gc_weak_table *t = gc_weak_table_new();
+
+    Employee *parrt = (Employee *) gc_alloc(&Employee_class);
+    gc_add_root(parrt);
+    String *v = gc_alloc_string(6);
+    strcpy(v->str, "cached");
+    gc_weak_table_put(t, (Object *) parrt, (Object *) v);
+    v = gc_alloc_string(10);
+    strcpy(v->str, "Terence");
+    parrt->name = gc_store(v);
+    v = NULL;
+
+    gc(); // the value is reached only through the table
+
+    check_state(LAYOUT(
+            "next_free=136\n"
+            "objects:\n"
+            "  0000:Employee[48]->[48,NULL]\n"
+            "  0048:String[32+11]=\"Terence\"\n"
+            "  0096:String[32+7]=\"cached\"\n",
+            "next_free=56\n"
+            "objects:\n"
+            "  0000:Employee[16]->[16,NULL]\n"
+            "  0016:String[8+11]=\"Terence\"\n"
+            "  0040:String[8+7]=\"cached\"\n"));
+    STR_ASSERT("cached", ((String *) gc_weak_table_get(t, (Object *) parrt))->str);
+
+    gc_weak_table_free(t);
+    gc_restore_roots;
+    gc_done();
+}
+
+// a pinned string stays put for zero-copy I/O; compaction slides around it
+
+void test_pinned_object_does_not_move() {
+    gc_init(1000);
+    gc_save_rp;
+
+    gc_alloc_string(20); // garbage
+    String *s = gc_alloc_string(10);
+    strcpy(s->str, "payload");
+    gc_pin((Object *) s); // pinned but not rooted
+    gc_alloc_string(20); // garbage
+    User *u = (User *) gc_alloc(&User_class);
+    gc_add_root(u);
+    String *name = gc_alloc_string(5);
+    strcpy(name->str, "parrt");
+    u->name = gc_store(name);
+
+    gc();
+
+    check_state(LAYOUT(
+            "next_free=192\n"
+            "objects:\n"
+            "  0000:hole[56]\n"
+            "  0056:String[32+11]=\"payload\"\n"
+            "  0104:User[48]->[152]\n"
+            "  0152:String[32+6]=\"parrt\"\n",
+            "next_free=96\n"
+            "objects:\n"
+            "  0000:hole[32]\n"
+            "  0032:String[8+11]=\"payload\"\n"
+            "  0056:User[20]->[80]\n"
+            "  0080:String[8+6]=\"parrt\"\n"));
+    STR_ASSERT("payload", s->str); // still where the kernel was told it is
+
+    String *t = gc_alloc_string(3); // reuses the hole
+    gc_add_root(t);
+    strcpy(t->str, "abc");
+
+    check_state(LAYOUT(
+            "next_free=192\n"
+            "objects:\n"
+            "  0000:String[32+4]=\"abc\"\n"
+            "  0040:hole[16]\n"
+            "  0056:String[32+11]=\"payload\"\n"
+            "  0104:User[48]->[152]\n"
+            "  0152:String[32+6]=\"parrt\"\n",
+            "next_free=96\n"
+            "objects:\n"
+            "  0000:String[8+4]=\"abc\"\n"
+            "  0016:hole[16]\n"
+            "  0032:String[8+11]=\"payload\"\n"
+            "  0056:User[20]->[80]\n"
+            "  0080:String[8+6]=\"parrt\"\n"));
+
+    gc_unpin((Object *) s);
+    s = NULL;
+
+    gc();
+
+    check_state(LAYOUT(
+            "next_free=128\n"
+            "objects:\n"
+            "  0000:String[32+4]=\"abc\"\n"
+            "  0040:User[48]->[88]\n"
+            "  0088:String[32+6]=\"parrt\"\n",
+            "next_free=56\n"
+            "objects:\n"
+            "  0000:String[8+4]=\"abc\"\n"
+            "  0016:User[20]->[40]\n"
+            "  0040:String[8+6]=\"parrt\"\n"));
+
+    gc_restore_roots;
+    gc_done();
+}
+
+void test_pin_count_and_dfs_order_slides() {
+    gc_init(1000);
+    gc_set_compaction_order(GC_ORDER_DFS);
+    gc_save_rp;
+
+    gc_alloc_string(20); // garbage
+    String *s = gc_alloc_string(10);
+    strcpy(s->str, "payload");
+    gc_add_root(s);
+    gc_pin((Object *) s);
+    gc_pin((Object *) s);
+    gc_unpin((Object *) s); // still pinned once
+
+    gc();
+
+    check_state(LAYOUT(
+            "next_free=104\n"
+            "objects:\n"
+            "  0000:hole[56]\n"
+            "  0056:String[32+11]=\"payload\"\n",
+            "next_free=56\n"
+            "objects:\n"
+            "  0000:hole[32]\n"
+            "  0032:String[8+11]=\"payload\"\n"));
+
+    gc_unpin((Object *) s);
+
+    gc(); // evacuated in traversal order again
+
+    check_state(LAYOUT(
+            "next_free=48\n"
+            "objects:\n"
+            "  0000:String[32+11]=\"payload\"\n",
+            "next_free=24\n"
+            "objects:\n"
+            "  0000:String[8+11]=\"payload\"\n"));
+
+    gc_restore_roots;
+    gc_done();
+}
+
+// with a compaction threshold, lightly fragmented heaps are only swept
+
+void test_sweep_leaves_hole_for_allocation() {
+    gc_init(1000);
+    gc_set_compaction_threshold(0.5);
+    gc_save_rp;
+
+    String *a = gc_alloc_string(10);
+    gc_add_root(a);
+    strcpy(a->str, "first");
+    gc_alloc_string(20); // garbage
+    String *b = gc_alloc_string(10);
+    gc_add_root(b);
+    strcpy(b->str, "second");
+
+    gc(); // 56 of 152 bytes free: below the threshold
+
+    check_state(LAYOUT(
+            "next_free=152\n"
+            "objects:\n"
+            "  0000:String[32+11]=\"first\"\n"
+            "  0048:hole[56]\n"
+            "  0104:String[32+11]=\"second\"\n",
+            "next_free=80\n"
+            "objects:\n"
+            "  0000:String[8+11]=\"first\"\n"
+            "  0024:hole[32]\n"
+            "  0056:String[8+11]=\"second\"\n"));
+
+    String *c = gc_alloc_string(10);
+    gc_add_root(c);
+    strcpy(c->str, "third");
+
+    check_state(LAYOUT(
+            "next_free=152\n"
+            "objects:\n"
+            "  0000:String[32+11]=\"first\"\n"
+            "  0048:String[32+11]=\"third\"\n"
+            "  0096:hole[8]\n"
+            "  0104:String[32+11]=\"second\"\n",
+            "next_free=80\n"
+            "objects:\n"
+            "  0000:String[8+11]=\"first\"\n"
+            "  0024:String[8+11]=\"third\"\n"
+            "  0048:hole[8]\n"
+            "  0056:String[8+11]=\"second\"\n"));
+
+    gc_stats stats;
+    gc_get_stats(&stats);
+    ASSERT(1, (int) stats.collections);
+    ASSERT(0, (int) stats.compactions);
+
+    gc_restore_roots;
+    gc_done();
+}
+
+void test_dead_neighbours_merge_with_hole() {
+    gc_init(1000);
+    gc_set_compaction_threshold(0.5);
+    gc_save_rp;
+
+    String *a = gc_alloc_string(10);
+    gc_add_root(a);
+    strcpy(a->str, "first");
+    gc_alloc_string(10); // garbage
+    Employee *e = (Employee *) gc_alloc(&Employee_class);
+    gc_add_root(e);
+    e->name = gc_store(a);
+
+    gc();
+
+    check_state(LAYOUT(
+            "next_free=144\n"
+            "objects:\n"
+            "  0000:String[32+11]=\"first\"\n"
+            "  0048:hole[48]\n"
+            "  0096:Employee[48]->[0,NULL]\n",
+            "next_free=64\n"
+            "objects:\n"
+            "  0000:String[8+11]=\"first\"\n"
+            "  0024:hole[24]\n"
+            "  0048:Employee[16]->[0,NULL]\n"));
+
+    e = NULL; // dead objects next to the hole merge with it
+
+    gc();
+
+    check_state(LAYOUT(
+            "next_free=48\n"
+            "objects:\n"
+            "  0000:String[32+11]=\"first\"\n",
+            "next_free=24\n"
+            "objects:\n"
+            "  0000:String[8+11]=\"first\"\n"));
+
+    gc_restore_roots;
+    gc_done();
+}
+
+void test_request_too_big_for_holes_keeps_them() {
+    gc_init(1000);
+    gc_set_compaction_threshold(0.5);
+    gc_save_rp;
+
+    String *a = gc_alloc_string(10);
+    gc_add_root(a);
+    strcpy(a->str, "first");
+    gc_alloc_string(20); // garbage
+    String *b = gc_alloc_string(10);
+    gc_add_root(b);
+    strcpy(b->str, "second");
+
+    gc(); // leaves a hole after a
+
+    String *c = gc_alloc_string(100); // fits no hole
+    gc_add_root(c);
+    strcpy(c->str, "third");
+    String *d = gc_alloc_string(10); // still fits the hole
+    gc_add_root(d);
+    strcpy(d->str, "fourth");
+
+    check_state(LAYOUT(
+            "next_free=288\n"
+            "objects:\n"
+            "  0000:String[32+11]=\"first\"\n"
+            "  0048:String[32+11]=\"fourth\"\n"
+            "  0096:hole[8]\n"
+            "  0104:String[32+11]=\"second\"\n"
+            "  0152:String[32+101]=\"third\"\n",
+            "next_free=192\n"
+            "objects:\n"
+            "  0000:String[8+11]=\"first\"\n"
+            "  0024:String[8+11]=\"fourth\"\n"
+            "  0048:hole[8]\n"
+            "  0056:String[8+11]=\"second\"\n"
+            "  0080:String[8+101]=\"third\"\n"));
+
+    gc_restore_roots;
+    gc_done();
+}
+
+void test_fragmentation_over_threshold_compacts() {
+    gc_init(1000);
+    gc_set_compaction_threshold(0.25);
+    gc_save_rp;
+
+    String *a = gc_alloc_string(10);
+    gc_add_root(a);
+    strcpy(a->str, "first");
+    gc_alloc_string(20); // garbage
+    String *b = gc_alloc_string(10);
+    gc_add_root(b);
+    strcpy(b->str, "second");
+    gc_alloc_string(10); // trailing garbage
+
+    gc(); // over half the heap is free
+
+    check_state(LAYOUT(
+            "next_free=96\n"
+            "objects:\n"
+            "  0000:String[32+11]=\"first\"\n"
+            "  0048:String[32+11]=\"second\"\n",
+            "next_free=48\n"
+            "objects:\n"
+            "  0000:String[8+11]=\"first\"\n"
+            "  0024:String[8+11]=\"second\"\n"));
+
+    gc_stats stats;
+    gc_get_stats(&stats);
+    ASSERT(1, (int) stats.compactions);
+    ASSERT((int) GC_ALIGN(sizeof(String) + 11), (int) stats.bytes_copied);
+
+    gc_restore_roots;
+    gc_done();
+}
+
+void test_sweep_returns_trailing_garbage() {
+    gc_init(1000);
+    gc_set_compaction_threshold(0.9);
+    gc_save_rp;
+
+    String *a = gc_alloc_string(10);
+    gc_add_root(a);
+    strcpy(a->str, "first");
+    gc_alloc_string(10); // garbage
+    gc_alloc_string(10); // garbage
+
+    gc();
+
+    check_state(LAYOUT(
+            "next_free=48\n"
+            "objects:\n"
+            "  0000:String[32+11]=\"first\"\n",
+            "next_free=24\n"
+            "objects:\n"
+            "  0000:String[8+11]=\"first\"\n"));
+
+    gc_restore_roots;
+    gc_done();
+}
+
+void test_alloc_failure_after_sweep_compacts() {
+    // room for everything but the garbage
+    gc_init(2 * GC_ALIGN(sizeof(String) + 11) + GC_ALIGN(sizeof(User)) + GC_ALIGN(sizeof(String) + 21));
+    gc_set_compaction_threshold(0.9);
+    gc_save_rp;
+
+    String *a = gc_alloc_string(10);
+    gc_add_root(a);
+    strcpy(a->str, "first");
+    gc_alloc_string(1); // garbage, too small a hole for c
+    String *b = gc_alloc_string(10);
+    gc_add_root(b);
+    strcpy(b->str, "second");
+    User *u = (User *) gc_alloc(&User_class);
+    gc_add_root(u);
+
+    String *c = gc_alloc_string(20);
+    gc_add_root(c);
+    strcpy(c->str, "third");
+
+    check_state(LAYOUT(
+            "next_free=200\n"
+            "objects:\n"
+            "  0000:String[32+11]=\"first\"\n"
+            "  0048:String[32+11]=\"second\"\n"
+            "  0096:User[48]->[NULL]\n"
+            "  0144:String[32+21]=\"third\"\n",
+            "next_free=104\n"
+            "objects:\n"
+            "  0000:String[8+11]=\"first\"\n"
+            "  0024:String[8+11]=\"second\"\n"
+            "  0048:User[20]->[NULL]\n"
+            "  0072:String[8+21]=\"third\"\n"));
+
+    gc_stats stats;
+    gc_get_stats(&stats);
+    ASSERT(2, (int) stats.collections);
+    ASSERT(1, (int) stats.compactions);
+
+    gc_restore_roots;
+    gc_done();
+}
+
+void test_goal_moves_heap_limit() {
+    gc_init(4000);
+    gc_save_rp;
+    gc_stats stats;
+    size_t live = GC_ALIGN(sizeof(String) + 11); // just a survives
+
+    String *a = gc_alloc_string(10);
+    gc_add_root(a);
+    strcpy(a->str, "first");
+
+    // a goal makes the first collection come at a quarter of the heap
+    gc_set_goal(GC_GOAL_PAUSE, 1e-9);
+    gc_get_stats(&stats);
+    ASSERT((int) GC_ALIGN(4000 / 4), (int) stats.heap_limit);
+    while(stats.collections == 0) {
+        gc_alloc_string(10); // garbage
+        gc_get_stats(&stats);
+    }
+    check_state(LAYOUT(
+            "next_free=96\n"
+            "objects:\n"
+            "  0000:String[32+11]=\"first\"\n"
+            "  0048:String[32+11]=\"\"\n",
+            "next_free=48\n"
+            "objects:\n"
+            "  0000:String[8+11]=\"first\"\n"
+            "  0024:String[8+11]=\"\"\n"));
+
+    // no heap is small enough for that pause, so keep just clear of the live
+    // data: its own size or a 64th of the heap past it, whichever is more
+    ASSERT((int) ((live + (live > 4000 / 64 ? live : 4000 / 64)) & ~(GC_ALIGNMENT - 1)),
+            (int) stats.heap_limit);
+
+    // the goal gives way rather than fail an allocation
+    String *b = gc_alloc_string(100);
+    gc_add_root(b);
+    strcpy(b->str, "second");
+    gc_get_stats(&stats);
+    ASSERT(4000, (int) stats.heap_limit);
+
+    // any heap meets a generous goal
+    gc_set_goal(GC_GOAL_PAUSE, 1e9);
+    gc_get_stats(&stats);
+    ASSERT((int) GC_ALIGN(4000 / 4), (int) stats.heap_limit);
+    long collections = stats.collections;
+    while(stats.collections == collections) {
+        gc_alloc_string(10); // garbage
+        gc_get_stats(&stats);
+    }
+    ASSERT(4000, (int) stats.heap_limit);
+
+    gc_set_goal(GC_GOAL_NONE, 0);
+    gc_get_stats(&stats);
+    ASSERT(4000, (int) stats.heap_limit);
+
+    gc_restore_roots;
+    gc_done();
+}
+
+void test_goal_releases_pages() {
+    gc_init(1 << 16);
+    gc_save_rp;
+    String *a = NULL;
+    gc_add_root(a);
+    int i;
+
+    // big strings overrun the limit and leave next_free off a page boundary
+    // when the limit shrinks again; GC_VERIFY checks the free pages released
+    gc_set_goal(GC_GOAL_PAUSE, 1e-9);
+    for(i = 0; i < 500; i++) {
+        String *s = gc_alloc_string(i % 7 == 0 ? 20000 : 50);
+        if(i % 10 == 0) {
+            a = s;
+        }
+    }
+
+    gc_stats stats;
+    gc_get_stats(&stats);
+    int shrunk = stats.heap_limit < 1 << 16;
+    ASSERT(1, shrunk);
+
+    gc_restore_roots;
+    gc_done();
+}
+
+void test_heaps_collect_independently() {
+    gc_heap_t *a = gc_heap_init(1000, 0);
+    gc_heap_t *b = gc_heap_init(1000, 0);
+    gc_heap_save_rp(a);
+    Employee *tombu, *parrt;
+    String *s;
+    char *found;
+
+    gc_heap_alloc_string(a, 20); // garbage in front of tombu
+    tombu = (Employee *) gc_heap_alloc(a, &Employee_class);
+    gc_heap_add_root(a, tombu);
+    s = gc_heap_alloc_string(a, 3);
+    strcpy(s->str, "Tom");
+    tombu->name = gc_heap_store(a, s);
+
+    parrt = (Employee *) gc_heap_alloc(b, &Employee_class); // not a root of b
+    s = gc_heap_alloc_string(b, 7);
+    strcpy(s->str, "Terence");
+    parrt->name = gc_heap_store(b, s);
+
+    gc_heap_collect(a);
+
+    found = gc_heap_get_state(a);
+    STATE_ASSERT(LAYOUT(
+            "next_free=88\n"
+            "objects:\n"
+            "  0000:Employee[48]->[48,NULL]\n"
+            "  0048:String[32+4]=\"Tom\"\n",
+            "next_free=32\n"
+            "objects:\n"
+            "  0000:Employee[16]->[16,NULL]\n"
+            "  0016:String[8+4]=\"Tom\"\n"), found);
+    free(found);
+    found = gc_heap_get_state(b);
+    STATE_ASSERT(LAYOUT(
+            "next_free=88\n"
+            "objects:\n"
+            "  0000:Employee[48]->[48,NULL]\n"
+            "  0048:String[32+8]=\"Terence\"\n",
+            "next_free=32\n"
+            "objects:\n"
+            "  0000:Employee[16]->[16,NULL]\n"
+            "  0016:String[8+8]=\"Terence\"\n"), found);
+    free(found);
+    ASSERT(1, gc_heap_num_roots(a));
+    ASSERT(0, gc_heap_num_roots(b));
+
+    // references are relative to their own heap
+    STR_ASSERT("Tom", ((String *) gc_heap_load(a, tombu->name))->str);
+    STR_ASSERT("Terence", ((String *) gc_heap_load(b, parrt->name))->str);
+
+    gc_heap_collect(b);
+    ASSERT(0, (int) gc_heap_used(b));
+
+    gc_heap_restore_roots(a);
+    ASSERT(0, gc_heap_num_roots(a));
+    gc_heap_done(a);
+    gc_heap_done(b);
+}
+
+void test_image_round_trip() {
+    char path[] = "/tmp/gc_imageXXXXXX";
+    ClassDescriptor *classes[] = {&Employee_class, NULL};
+    Employee *tombu, *parrt = NULL;
+    String *s;
+
+    close(mkstemp(path));
+    gc_init(1000);
+    {
+        gc_save_rp;
+        gc_add_root(parrt);
+        tombu = (Employee *) gc_alloc(&Employee_class);
+        s = gc_alloc_string(3);
+        strcpy(s->str, "Tom");
+        tombu->name = gc_store(s);
+        gc_alloc_string(20); // garbage left out of the image
+        parrt = (Employee *) gc_alloc(&Employee_class);
+        s = gc_alloc_string(7);
+        strcpy(s->str, "Terence");
+        parrt->name = gc_store(s);
+        parrt->mgr = gc_store(tombu);
+
+        ASSERT(GC_IMAGE_OK, gc_save_image(path));
+        gc_restore_roots;
+        gc_done();
+    }
+
+    parrt = NULL;
+    gc_init(1000);
+    {
+        gc_save_rp;
+        gc_add_root(parrt);
+        ASSERT(GC_IMAGE_OK, gc_load_image(path, classes));
+
+        check_state(LAYOUT(
+                "next_free=176\n"
+                "objects:\n"
+                "  0000:Employee[48]->[48,NULL]\n"
+                "  0048:String[32+4]=\"Tom\"\n"
+                "  0088:Employee[48]->[136,0]\n"
+                "  0136:String[32+8]=\"Terence\"\n",
+                "next_free=64\n"
+                "objects:\n"
+                "  0000:Employee[16]->[16,NULL]\n"
+                "  0016:String[8+4]=\"Tom\"\n"
+                "  0032:Employee[16]->[48,0]\n"
+                "  0048:String[8+8]=\"Terence\"\n"));
+        tombu = gc_load(parrt->mgr);
+        STR_ASSERT("Tom", ((String *) gc_load(tombu->name))->str);
+
+        // the loaded heap is an ordinary heap
+        parrt->mgr = gc_store(NULL);
+        gc();
+        ASSERT((int) (GC_ALIGN(sizeof(Employee)) + GC_ALIGN(sizeof(String) + 8)), (int) gc_used());
+        STR_ASSERT("Terence", ((String *) gc_load(parrt->name))->str);
+
+        gc_restore_roots;
+        gc_done();
+    }
+    unlink(path);
+}
+
+void test_resave_keeps_loaded_image() {
+    char path[] = "/tmp/gc_imageXXXXXX";
+    ClassDescriptor *classes[] = {NULL};
+    gc_heap_t *a, *b;
+    String *s = NULL;
+
+    close(mkstemp(path));
+    a = gc_heap_init(1000, 0);
+    {
+        gc_heap_save_rp(a);
+        gc_heap_add_root(a, s);
+        s = gc_heap_alloc_string(a, 5);
+        strcpy(s->str, "first");
+        ASSERT(GC_IMAGE_OK, gc_heap_save_image(a, path));
+        gc_heap_restore_roots(a);
+    }
+    gc_heap_done(a);
+
+    // a loaded compact image shares the file's pages until written to
+    s = NULL;
+    a = gc_heap_init(1000, 0);
+    gc_heap_save_rp(a);
+    gc_heap_add_root(a, s);
+    ASSERT(GC_IMAGE_OK, gc_heap_load_image(a, path, classes));
+
+    // as another process would, save a different image to the same path
+    b = gc_heap_init(1000, 0);
+    {
+        String *t = NULL;
+        gc_heap_save_rp(b);
+        gc_heap_add_root(b, t);
+        t = gc_heap_alloc_string(b, 6);
+        strcpy(t->str, "second");
+        ASSERT(GC_IMAGE_OK, gc_heap_save_image(b, path));
+        gc_heap_restore_roots(b);
+    }
+    gc_heap_done(b);
+
+    STR_ASSERT("first", s->str);
+    gc_heap_restore_roots(a);
+    gc_heap_done(a);
+    unlink(path);
+}
+
+/* gc_load_image() with its complaint sent to /dev/null */
+int load_quietly(char *path, ClassDescriptor **classes) {
+    int status, out = dup(1), null = open("/dev/null", O_WRONLY);
+
+    fflush(stdout);
+    dup2(null, 1);
+    status = gc_load_image(path, classes);
+    fflush(stdout);
+    dup2(out, 1);
+    close(out);
+    close(null);
+    return status;
+}
+
+/* overwrite size bytes of the image file at offset, returning what was there */
+uint64_t patch_image(char *path, long offset, uint64_t value, size_t size) {
+    uint64_t old = 0;
+    FILE *f = fopen(path, "r+b");
+
+    fseek(f, offset, SEEK_SET);
+    fread(&old, size, 1, f);
+    fseek(f, offset, SEEK_SET);
+    fwrite(&value, size, 1, f);
+    fclose(f);
+    return old;
+}
+
+void test_damaged_image_is_rejected() {
+    char path[] = "/tmp/gc_imageXXXXXX";
+    ClassDescriptor *classes[] = {&Employee_class, NULL};
+    Employee *parrt = NULL;
+    long page = sysconf(_SC_PAGESIZE);
+    uint64_t old;
+
+    close(mkstemp(path));
+    gc_init(1000);
+    {
+        gc_save_rp;
+        gc_add_root(parrt);
+        parrt = (Employee *) gc_alloc(&Employee_class);
+        parrt->name = gc_store(gc_alloc_string(7));
+        ASSERT(GC_IMAGE_OK, gc_save_image(path));
+        gc_restore_roots;
+    }
+    gc_done();
+
+    parrt = NULL;
+    gc_init(1000);
+    {
+        gc_save_rp;
+        gc_add_root(parrt);
+
+        // maxClassId, then numRelocs, far beyond what the file holds
+        old = patch_image(path, 20, 0xffffffff, 4);
+        ASSERT(GC_IMAGE_FORMAT, load_quietly(path, classes));
+        patch_image(path, 20, old, 4);
+        old = patch_image(path, 32, (uint64_t) 1 << 61, 8);
+        ASSERT(GC_IMAGE_FORMAT, load_quietly(path, classes));
+        patch_image(path, 32, old, 8);
+
+        // a root past the saved heap; the roots follow the Employee and
+        // String descriptors: id, name length, name, size, field count, offsets
+        long roots = 48 + 2 * (4 + 4 + 8 + 4) + strlen("Employee") + strlen("String") +
+                4 * Employee_class.num_fields;
+        old = patch_image(path, roots, 1000, 8);
+        ASSERT(GC_IMAGE_FORMAT, load_quietly(path, classes));
+        patch_image(path, roots, old, 8);
+
+        // a class id no class was saved under, found only once the data is in
+        old = patch_image(path, page, 0xffff, 4);
+        ASSERT(GC_IMAGE_FORMAT, load_quietly(path, classes));
+        patch_image(path, page, old, 4);
+        gc(); // GC_VERIFY checks the heap is empty free space again
+        check_state(
+                "next_free=0\n"
+                "objects:\n");
+
+        ASSERT(GC_IMAGE_OK, load_quietly(path, classes));
+        gc_restore_roots;
+    }
+    gc_done();
+
+    // cut where the heap data begins, so mapping it would still succeed
+    truncate(path, page);
+    parrt = NULL;
+    gc_init(1000);
+    {
+        gc_save_rp;
+        gc_add_root(parrt);
+        ASSERT(GC_IMAGE_FORMAT, load_quietly(path, classes));
+        gc_restore_roots;
+    }
+    gc_done();
+    unlink(path);
+}
+
+#ifdef GC_VERIFY
+/* whether the heap verifier aborts a child running corrupt_and_gc() */
+int verifier_aborts(void (*corrupt_and_gc)()) {
+    int status;
+    pid_t pid = fork();
+
+    if(pid == 0) {
+        freopen("/dev/null", "w", stderr);
+        corrupt_and_gc();
+        _exit(0);
+    }
+    waitpid(pid, &status, 0);
+    return WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT;
+}
+
+void point_into_middle_of_object() {
+    gc_init(1000);
+    gc_save_rp;
+
+    Employee *tombu = (Employee *) gc_alloc(&Employee_class);
+    Employee *parrt = (Employee *) gc_alloc(&Employee_class);
+    gc_add_root(parrt);
+    parrt->mgr = gc_store((void *) tombu + 8);
+    gc();
+
+    gc_restore_roots;
+    gc_done();
+}
+
+void write_through_stale_pointer() {
+    gc_init(1000);
+
+    String *s = gc_alloc_string(10);
+    gc(); // s was never rooted, so its space is free again
+    strcpy(s->str, "oops");
+    gc();
+
+    gc_done();
+}
+
+#ifndef GC_COMPACT_HEADERS
+// the check gc() runs between computing forwarding addresses and moving
+void verifyForwarding(gc_heap_t *h);
+
+// a slides down over dead space; b is forwarded past its own address
+void forward_upwards() {
+    gc_heap_t *h = gc_heap_init(1000, 0);
+
+    gc_heap_alloc_string(h, 10); // dead
+    String *a = gc_heap_alloc_string(h, 10);
+    String *b = gc_heap_alloc_string(h, 10);
+    a->forwarded = (Object *) ((void *) a - 48);
+    b->forwarded = (Object *) ((void *) b + 48);
+    verifyForwarding(h);
+
+    gc_heap_done(h);
+}
+
+void forward_downwards() {
+    gc_heap_t *h = gc_heap_init(1000, 0);
+
+    gc_heap_alloc_string(h, 10); // dead
+    String *a = gc_heap_alloc_string(h, 10);
+    String *b = gc_heap_alloc_string(h, 10);
+    a->forwarded = (Object *) ((void *) a - 48);
+    b->forwarded = (Object *) ((void *) b - 48);
+    verifyForwarding(h);
+
+    gc_heap_done(h);
+}
+#endif
+
+void test_verify_catches_corruption() {
+    ASSERT(1, verifier_aborts(point_into_middle_of_object));
+    ASSERT(1, verifier_aborts(write_through_stale_pointer));
+#ifndef GC_COMPACT_HEADERS
+    ASSERT(0, verifier_aborts(forward_downwards));
+    ASSERT(1, verifier_aborts(forward_upwards));
+#endif
+}
+#endif
+
+void test_template() {
+    gc_init(1000);
+    gc_save_rp;
+
+    // gc_add_root(s);
+
+    gc_restore_roots;
+    gc_done();
+}
+
+void test_automatic_gc() {
+    // room for one user and its name
+    gc_init(GC_ALIGN(sizeof(User)) + GC_ALIGN(sizeof(String) + 7));
+    gc_save_rp;
+
+    User *u = (User *) gc_alloc(&User_class);
+    gc_add_root(u);
+
+    String *s = gc_alloc_string(5);
+    strcpy(s->str, "parrt");
+    u->name = gc_store(s);
+
+    {
+        char *expected = LAYOUT( // compacts out dead stuff
+                "next_free=88\n"
+                "objects:\n"
+                "  0000:User[48]->[48]\n"
+                "  0048:String[32+6]=\"parrt\"\n",
+                "next_free=40\n"
+                "objects:\n"
+                "  0000:User[20]->[24]\n"
+                "  0024:String[8+6]=\"parrt\"\n");
+        char *found = gc_get_state();
+        STATE_ASSERT(expected, found);
+        free(found);
+    }
+
+    u = NULL; // should free user and string
+
+    User *q = (User *) gc_alloc(&User_class);
+    gc_add_root(q);
+
+    s = gc_alloc_string(6);
+    strcpy(s->str, "steely");
+    q->name = gc_store(s);
+
+    {
+        char *expected = LAYOUT( // compacts out dead stuff
+                "next_free=88\n"
+                "objects:\n"
+                "  0000:User[48]->[48]\n"
+                "  0048:String[32+7]=\"steely\"\n",
+                "next_free=40\n"
+                "objects:\n"
+                "  0000:User[20]->[24]\n"
+                "  0024:String[8+7]=\"steely\"\n");
+
+        char *found = gc_get_state();
+        STATE_ASSERT(expected, found);
+        free(found);
+    }
+
+    gc_restore_roots;
+    gc_done();
+}
+
+#ifndef GC_COMPACT_HEADERS /* prints the class pointer of the full header */
+void test_loop() {
+    gc_init(500);
+    gc_save_rp;
+
+	Employee *parrt;
+   	gc_add_root(parrt);
+
+	int i;
+	parrt = (Employee *) gc_alloc(&Employee_class);
+
+	for (i=0;i<1000;i++){
+      printf("\n*****************iteration %d*****************\n\n", i);
+      // parrt = NULL;
+		parrt = (Employee *) gc_alloc(&Employee_class);
+		parrt->name = gc_alloc_string(10);
+      printf("parrt->name: %s\n", parrt->class->name);
+	}
+    strcpy(parrt->name->str, "Terence");
+
+    gc();
+
+    {
+        char *expected = // compacts out dead stuff
+            "next_free=96\n"
+            "objects:\n"
+            "  0000:Employee[48]->[48,NULL]\n"
+            "  0048:String[32+11]=\"Terence\"\n";
+        char *found = gc_get_state();
+        STATE_ASSERT(expected, found);
+        free(found);
+    }
+
     gc_restore_roots;
     gc_done();
 }
+#endif
 
 int main(int argc, char *argv[]) {
+   test_header_sizes();
    test_alloc_str_gc_compact_does_nothing();
    test_alloc_str_set_null_gc();
    test_alloc_2_str_overwrite_first_one_gc();
@@ -503,5 +1883,36 @@ int main(int argc, char *argv[]) {
    test_mgr_cycle();
    test_mgr_cycle_kill_one_link();
    test_automatic_gc();
+   test_slide_over_own_header();
+   test_alloc_is_aligned();
+   test_slide_across_mark_words();
+   test_dfs_order();
+   test_bfs_order();
+   test_dfs_order_cycle_drops_garbage();
+   test_huge_page_numa_heap();
+   test_weak_ref_cleared();
+   test_weak_ref_follows_moved_referent();
+   test_weak_table_entry_dies_with_key();
+   test_weak_table_ignores_null_key();
+   test_weak_table_value_pointing_at_key_dies();
+   test_finalizer_runs_outside_gc();
+   test_weak_table_with_dfs_order();
+   test_pinned_object_does_not_move();
+   test_pin_count_and_dfs_order_slides();
+   test_sweep_leaves_hole_for_allocation();
+   test_dead_neighbours_merge_with_hole();
+   test_request_too_big_for_holes_keeps_them();
+   test_fragmentation_over_threshold_compacts();
+   test_sweep_returns_trailing_garbage();
+   test_alloc_failure_after_sweep_compacts();
+   test_goal_moves_heap_limit();
+   test_goal_releases_pages();
+   test_heaps_collect_independently();
+   test_image_round_trip();
+   test_resave_keeps_loaded_image();
+   test_damaged_image_is_rejected();
+#ifdef GC_VERIFY
+   test_verify_catches_corruption();
+#endif
    return 0;
 }